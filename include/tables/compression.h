@@ -0,0 +1,32 @@
+#ifndef __tables_compression_h
+#define __tables_compression_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tables
+{
+
+// A small LZ77 codec (in the spirit of LZ4) for row values. Matches may reach back into an optional
+// dictionary, which is what makes compressing short, repetitive rows worthwhile.
+//
+// The stream is a series of sequences, each a token byte (literal count in the high nibble, match
+// length - 4 in the low nibble, 15 meaning more length bytes follow), the literals, then a 2 byte little
+// endian match offset and any extra match length bytes. The last sequence has only literals.
+
+// Matches reach back at most 65535 bytes. Capping dictionaries at half that keeps all of the dictionary
+// in reach from anywhere in the first 32 KB of a row, which covers the short rows dictionaries are for.
+const size_t LZ_MAX_DICTIONARY_SIZE = 32768;
+
+std::string lz_compress(const uint8_t* src, size_t size, const std::string& dictionary = std::string());
+
+// Throws if src is malformed or doesn't decompress to exactly rawSize bytes.
+std::string lz_decompress(const uint8_t* src, size_t size, size_t rawSize, const std::string& dictionary = std::string());
+
+// Builds a dictionary of at most maxSize bytes out of the substrings most commonly shared by samples.
+std::string lz_train_dictionary(const std::vector<std::string>& samples, size_t maxSize);
+
+}
+
+#endif
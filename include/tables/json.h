@@ -3343,7 +3343,8 @@ class parser
 
                     if (keep and keep_tag and not value.is_discarded())
                     {
-                        result.m_value.object->emplace(std::move(key), std::move(value));
+                        // duplicate keys keep their last value (as nlohmann/json does from 3.2.0 on)
+                        result.m_value.object->operator[](std::move(key)) = std::move(value);
                     }
 
                     // comma -> next value
@@ -10,12 +10,14 @@
 // - TEST: remove() row w/ no indexes, row w/ indexes, row w/ indexes and compound indexes.
 // - TEST: atomicity of transactions.
 // - TEST: No columns
-// - TEST: what happens when the map fills up?
 // - TEST: Performance when you have 1 million rows?
 
 #include "liblmdb/lmdb.h"
 #include "tables/json.h"
 #include "tables/utils.h"
+#include "tables/row_codec.h"
+#include "tables/compression.h"
+#include "tables/json_extractor.h"
 #include <string>
 #include <vector>
 #include <map>
@@ -23,17 +25,163 @@
 #include <functional>
 #include <stdexcept>
 #include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <istream>
+#include <queue>
+#include <deque>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <limits>
+#include <memory>
 
 class json_database_test;
 
+// Every table and every index lives in its own named LMDB sub-database. Since the schema can't be read
+// before the environment is opened json_database handles reserve this many sub-database slots.
+#ifndef TABLES_MAX_DBS
+#define TABLES_MAX_DBS 256
+#endif
+
+// How long a map resize waits for this process's readers to finish.
+#ifndef TABLES_RESIZE_WAIT_MS
+#define TABLES_RESIZE_WAIT_MS 10000
+#endif
+
 namespace tables
 {
 
+// Our pk's are stored as native integers in MDB_INTEGERKEY tables, which LMDB supports for unsigned int
+// and size_t keys.
+static_assert(sizeof(size_t) == sizeof(uint64_t), "tables requires a 64 bit size_t.");
+
+// The type of an indexed column determines how its values are encoded in index keys. Every type has
+// an order preserving encoding, so iterating an index visits rows in the natural order of the type.
+enum class column_type
+{
+    STRING,     // JSON string (numbers are indexed by their text)
+    BYTES,      // JSON string of hex digits, indexed as the raw bytes
+    INT64,      // JSON number or numeric string
+    UINT64,     // JSON number or numeric string
+    DOUBLE,     // JSON number or numeric string
+    TIMESTAMP,  // Milliseconds since the epoch as an int64
+    UUID        // JSON string "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx", indexed as 16 raw bytes
+};
+
+struct index_info
+{
+    std::vector<std::string> columns;
+    std::vector<column_type> types;
+
+    // Columns whose values are copied into the index entries (a covering index) so index only scans
+    // never have to read the row.
+    std::vector<std::string> include;
+    MDB_dbi dbi {0};
+};
+
 struct table_info
 {
     std::vector<std::string> regular_columns;
     std::vector<std::string> index_columns;
     std::vector<std::vector<std::string>> compound_indexes;
+
+    // Columns not listed here are STRING.
+    std::map<std::string, column_type> column_types;
+
+    // index_columns followed by compound_indexes, in schema order.
+    std::vector<index_info> indexes;
+
+    // Rows are stored as the JSON text they were inserted with unless the schema asks for binary rows.
+    bool binary_rows {false};
+    row_codec codec;
+
+    // Rows of compressed tables are lz_compress()'d, against the table's current dictionary if it has one.
+    bool compressed {false};
+
+    // Rows whose ttl column (a timestamp index, ttl_index in indexes) is more than ttl_ms in the past are
+    // expired. ttl_index is -1 for tables without a ttl.
+    int ttl_index {-1};
+    int64_t ttl_ms {0};
+
+    // Pulls the index and include columns out of JSON rows.
+    json_extractor extractor;
+    MDB_dbi dbi {0};
+};
+
+struct table_stats
+{
+    uint64_t rows {0};
+    uint64_t data_bytes {0};    // Row bytes before compression.
+    uint64_t stored_bytes {0};  // Row bytes as stored.
+
+    double compression_ratio() const { return (stored_bytes > 0) ? (double)data_bytes / stored_bytes : 1.0; }
+};
+
+// How hard commits try to reach the disk. With MDB_WRITEMAP every commit normally msync()s the pages
+// it dirtied and then the meta page.
+enum class durability
+{
+    full,           // Sync data and meta pages on every commit.
+    no_meta_sync,   // Skip the meta page sync; a crash can lose the last commit but never corrupts.
+    periodic_sync,  // Don't sync on commit; a background thread syncs every interval (or byte threshold).
+    map_async       // Let the OS flush dirty pages whenever it likes.
+};
+
+struct sync_metrics
+{
+    uint64_t syncs {0};
+    uint64_t failed_syncs {0};
+    std::chrono::microseconds last_sync_latency {0};
+    std::chrono::microseconds max_sync_latency {0};
+    std::chrono::milliseconds since_last_sync {0};
+    uint64_t unsynced_bytes {0};    // Row bytes committed (in periodic_sync or map_async) since the last sync.
+};
+
+// Bytes owned by an iterator: in the map itself, or (for compressed rows) in the iterator's buffer.
+// A view is only good until its iterator moves (find(), next(), prev() or current_pks()), is moved from
+// or is destroyed. Debug builds (no NDEBUG) throw from data() and size() when a view is used after any
+// of those. Views share a generation counter with their iterator (by weak_ptr) so they can tell.
+class data_view final
+{
+public:
+    data_view() = default;
+
+    const uint8_t* data() const { _check(); return _data; }
+    size_t size() const { _check(); return _size; }
+    std::string str() const { return std::string((const char*)data(), size()); }
+
+private:
+    friend class json_database;
+
+    data_view(const uint8_t* data, size_t size, const std::shared_ptr<uint64_t>& generation) :
+        _data(data),
+        _size(size),
+        _generation(generation),
+        _expected(*generation)
+    {
+    }
+
+    void _check() const
+    {
+#ifndef NDEBUG
+        // Generations start at 1, so 0 is a default constructed view.
+        if(_expected != 0)
+        {
+            auto generation = _generation.lock();
+            if(!generation || *generation != _expected)
+                throw std::runtime_error(("data_view used after its iterator moved."));
+        }
+#endif
+    }
+
+    const uint8_t* _data {NULL};
+    size_t _size {0};
+    std::weak_ptr<const uint64_t> _generation;
+    uint64_t _expected {0};
 };
 
 class json_database final
@@ -44,27 +192,43 @@ public:
     class iterator final
     {
     public:
-        iterator(const json_database* db, const std::string& tableName, const std::string& index = std::string()) :
+        iterator(const json_database* db, const std::string& tableName, const std::vector<std::string>& index = std::vector<std::string>()) :
             _db(db),
             _index(index),
             _tableName(tableName),
             _txn(NULL),
-            _dbi(),
+            _dbi(db->_index_dbi(tableName, index)),
+            _types((index.empty()) ? std::vector<column_type>() : json_database::_index(db->_table(tableName), index).types),
+            _covering(!index.empty() && !json_database::_index(db->_table(tableName), index).include.empty()),
+            _codec((db->_table(tableName).binary_rows) ? &db->_table(tableName).codec : NULL),
+            _compressed(db->_table(tableName).compressed),
+            _rowDbi(db->_table(tableName).dbi),
             _indexCursor(NULL),
             _validIterator(false),
             _shimKey(),
             _shimVal(),
-            _closed(false)
+            _closed(false),
+            _pkBatch(),
+            _rowBuffer(),
+            _generation(std::make_shared<uint64_t>(1)),
+            _rowGeneration(0),
+            _range(false),
+            _loOpen(true),
+            _hiOpen(true),
+            _loInclusive(true),
+            _hiInclusive(false),
+            _loKey(),
+            _hiKey()
         {
-            if(mdb_txn_begin(db->_env, NULL, MDB_RDONLY, &_txn) != 0)
-                throw std::runtime_error(("Unable to create transaction."));
-            if(mdb_dbi_open(_txn, NULL, 0, &_dbi) != 0)
-                throw std::runtime_error(("Unable to open/create json_database."));
+            _txn = db->_begin_read();
             if(mdb_cursor_open(_txn, _dbi, &_indexCursor) != 0)
+            {
+                db->_end_read(_txn);
                 throw std::runtime_error(("Unable to create cursor."));
+            }
 
-            // Empty search value should cause iterator to go to beginning of index.
-            find(std::string());
+            // Iterators start at the beginning of their table or index.
+            _validIterator = (mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_FIRST) == 0);
         }
 
         iterator(const iterator&) = delete;
@@ -75,17 +239,37 @@ public:
             _tableName(std::move(obj._tableName)),
             _txn(std::move(obj._txn)),
             _dbi(std::move(obj._dbi)),
+            _types(std::move(obj._types)),
+            _covering(std::move(obj._covering)),
+            _codec(std::move(obj._codec)),
+            _compressed(std::move(obj._compressed)),
+            _rowDbi(std::move(obj._rowDbi)),
             _indexCursor(std::move(obj._indexCursor)),
             _validIterator(std::move(obj._validIterator)),
             _shimKey(std::move(obj._shimKey)),
             _shimVal(std::move(obj._shimVal)),
-            _closed(std::move(obj._closed))
+            _closed(std::move(obj._closed)),
+            _pkBatch(std::move(obj._pkBatch)),
+            _rowBuffer(std::move(obj._rowBuffer)),
+            _generation(std::move(obj._generation)),
+            _rowGeneration(0),
+            _range(std::move(obj._range)),
+            _loOpen(std::move(obj._loOpen)),
+            _hiOpen(std::move(obj._hiOpen)),
+            _loInclusive(std::move(obj._loInclusive)),
+            _hiInclusive(std::move(obj._hiInclusive)),
+            _loKey(std::move(obj._loKey)),
+            _hiKey(std::move(obj._hiKey))
         {
             obj._db = NULL;
             obj._txn = NULL;
             obj._indexCursor = NULL;
             obj._validIterator = false;
             obj._closed = true;
+
+            // Views of obj are stale (a compressed row's buffer has moved).
+            if(_generation)
+                ++*_generation;
         }
 
         ~iterator() noexcept
@@ -106,6 +290,11 @@ public:
             _txn = std::move(obj._txn);
             obj._txn = NULL;
             _dbi = std::move(obj._dbi);
+            _types = std::move(obj._types);
+            _covering = std::move(obj._covering);
+            _codec = std::move(obj._codec);
+            _compressed = std::move(obj._compressed);
+            _rowDbi = std::move(obj._rowDbi);
             _indexCursor = std::move(obj._indexCursor);
             obj._indexCursor = NULL;
             _validIterator = std::move(obj._validIterator);
@@ -114,29 +303,45 @@ public:
             _shimVal = std::move(obj._shimVal);
             _closed = std::move(obj._closed);
             obj._closed = true;
+            _pkBatch = std::move(obj._pkBatch);
+            _rowBuffer = std::move(obj._rowBuffer);
+            _generation = std::move(obj._generation);
+            if(_generation)
+                ++*_generation;
+            _rowGeneration = 0;
+            _range = std::move(obj._range);
+            _loOpen = std::move(obj._loOpen);
+            _hiOpen = std::move(obj._hiOpen);
+            _loInclusive = std::move(obj._loInclusive);
+            _hiInclusive = std::move(obj._hiInclusive);
+            _loKey = std::move(obj._loKey);
+            _hiKey = std::move(obj._hiKey);
 
             return *this;
         }
 
-        void find(const std::string& val)
+        // Moves to the first entry >= val. pk iterators find() a uint64_t pk, index iterators find() a
+        // value of the indexes (first) column's type: find(1469397588523) and find("1469397588523") are
+        // the same thing on an INT64 or TIMESTAMP column. On a compound index find() positions on the
+        // first entry with the given leading value. find() drops any range set by find_range().
+        template<typename T>
+        void find(const T& val)
         {
             if(_closed)
                 throw std::runtime_error(("Unable to find() on close()d iterators."));
 
-            std::string key, prefix;
+            nlohmann::json j = val;
 
             if(_index.empty())
             {
-                key = _tableName + "_" + val;
-                prefix = _tableName;
-            }
-            else
-            {
-                key = "index_" + _tableName + _index + "_" + val;
-                prefix = "index_" + _tableName + _index;
-            }
+                if(!j.is_number_integer())
+                    throw std::runtime_error(("pk iterators must find() a uint64_t pk."));
+
+                auto key = _row_key(j.get<uint64_t>());
 
-            _set_cursor(key, prefix);
+                _set_cursor(key);
+            }
+            else _find_values(nlohmann::json::array({j}));
         }
 
         void find(const std::vector<std::string>& vals)
@@ -144,14 +349,72 @@ public:
             if(_closed)
                 throw std::runtime_error(("Unable to find() on close()d iterators."));
 
-            std::string cv;
-            for(auto v : vals)
-                cv += "_" + v;
+            _find_values(nlohmann::json(vals));
+        }
+
+        void find(const std::vector<nlohmann::json>& vals)
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to find() on close()d iterators."));
+
+            _find_values(nlohmann::json(vals));
+        }
+
+        // Positions on the first entry in [lo, hi) (or (lo, hi], etc, per the inclusive flags) and keeps
+        // next() and prev() inside that range: stepping past either end of it makes the iterator invalid.
+        // With reverse it starts on the last entry in the range instead, ready to walk back with prev().
+        // Bounds are what find() takes (pks for pk iterators, arrays of leading values on a compound
+        // index) and a null bound leaves that end open. Bounds are encoded once here so each step is
+        // just a memcmp() against the cursor's key.
+        void find_range(const nlohmann::json& lo, const nlohmann::json& hi, bool loInclusive = true, bool hiInclusive = false, bool reverse = false)
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to find_range() on close()d iterators."));
+
+            _loOpen = lo.is_null();
+            _hiOpen = hi.is_null();
+            _loKey = (_loOpen) ? std::string() : _bound_key(lo);
+            _hiKey = (_hiOpen) ? std::string() : _bound_key(hi);
+            _loInclusive = loInclusive;
+            _hiInclusive = hiInclusive;
+            _range = true;
+
+            ++*_generation;
+
+            int rc;
+            std::string key;
+
+            if(!reverse)
+            {
+                // An exclusive lo starts after every key that begins with it.
+                key = _loKey;
+                if(_loOpen)
+                    rc = _cursor_get(key, MDB_FIRST);
+                else if(_loInclusive || _successor(key))
+                    rc = _cursor_get(key, MDB_SET_RANGE);
+                else rc = MDB_NOTFOUND;
+            }
+            else
+            {
+                // Find the first key past the range and back up one (an inclusive hi ends after every
+                // key that begins with it).
+                key = _hiKey;
+                if(_hiOpen || (_hiInclusive && !_successor(key)))
+                    rc = _cursor_get(key, MDB_LAST);
+                else
+                {
+                    rc = _cursor_get(key, MDB_SET_RANGE);
+                    if(rc == 0)
+                        rc = _cursor_get(key, MDB_PREV);
+                    else if(rc == MDB_NOTFOUND)
+                        rc = _cursor_get(key, MDB_LAST);
+                }
+            }
 
-            auto key = "index_" + _tableName + _index + cv;
-            auto prefix = "index_" + _tableName + _index;
+            if(rc != 0 && rc != MDB_NOTFOUND)
+                throw std::runtime_error(("Unable to position cursor."));
 
-            _set_cursor(key, prefix);
+            _validIterator = (rc == 0 && _in_range());
         }
 
         void next()
@@ -162,9 +425,7 @@ public:
             if(!_validIterator)
                 throw std::runtime_error(("Invalid iterator!"));
 
-            auto prefix = (_index.empty())?_tableName:"index_" + _tableName + _index;
-
-            _next_cursor(prefix);
+            _next_cursor();
         }
 
         void prev()
@@ -175,9 +436,7 @@ public:
             if(!_validIterator)
                 throw std::runtime_error(("Invalid iterator!"));
 
-            auto prefix = (_index.empty())?_tableName:"index_" + _tableName + _index;
-
-            _prev_cursor(prefix);
+            _prev_cursor();
         }
 
         bool valid() const
@@ -188,7 +447,7 @@ public:
             return _validIterator;
         }
 
-        std::string current_pk() const
+        uint64_t current_pk() const
         {
             if(_closed)
                 throw std::runtime_error(("Unable to current_pk() on close()d iterators."));
@@ -196,16 +455,86 @@ public:
             if(!_validIterator)
                 throw std::runtime_error(("Invalid iterator!"));
 
-            auto key = std::string((char*)_shimVal.mv_data, _shimVal.mv_size);
+            // For pk iterators our key is the pk, for index iterators the pk is in our value.
+            if(_index.empty())
+                return _native_pk(_shimKey);
+
+            return (_covering) ? _covering_pk(_shimVal) : _native_pk(_shimVal);
+        }
+
+        // Calls pcb(const uint64_t* pks, size_t count) with every pk stored under the current index value,
+        // a page of them at a time. Afterwards the iterator is on the last of them so next() moves on to
+        // the next index value.
+        template<typename PKCB>
+        void current_pks(PKCB pcb)
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to current_pks() on close()d iterators."));
+
+            if(!_validIterator)
+                throw std::runtime_error(("Invalid iterator!"));
+
+            if(_index.empty())
+                throw std::runtime_error(("Unable to current_pks() on a pk iterator."));
 
-            auto runder_index = key.rfind('_');
+            ++*_generation;
 
-            if(runder_index == std::string::npos)
-                throw std::runtime_error(("Malformed primary key."));
+            MDB_val key, val;
+
+            if(mdb_cursor_get(_indexCursor, &key, &val, MDB_FIRST_DUP) != 0)
+                throw std::runtime_error(("Unable to find first duplicate."));
+
+            if(_covering)
+            {
+                // Covering index entries aren't fixed size so they have to be walked one at a time.
+                const size_t batchSize = 512;
+
+                int rc = 0;
+                while(rc == 0)
+                {
+                    _pkBatch.clear();
+
+                    while(rc == 0 && _pkBatch.size() < batchSize)
+                    {
+                        _pkBatch.push_back(_covering_pk(val));
+                        rc = mdb_cursor_get(_indexCursor, &key, &val, MDB_NEXT_DUP);
+                    }
+
+                    pcb((const uint64_t*)&_pkBatch[0], _pkBatch.size());
+                }
+
+                if(rc != MDB_NOTFOUND)
+                    throw std::runtime_error(("Unable to read duplicates."));
+
+                if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_GET_CURRENT) != 0)
+                    _validIterator = false;
+
+                return;
+            }
+
+            // Note: for a value with a single pk MDB_GET_MULTIPLE leaves val as MDB_FIRST_DUP found it.
+            auto rc = mdb_cursor_get(_indexCursor, &key, &val, MDB_GET_MULTIPLE);
+
+            while(rc == 0)
+            {
+                // Copy out of the page since LMDB makes no alignment promises for its data.
+                _pkBatch.resize(val.mv_size / sizeof(uint64_t));
+                memcpy(&_pkBatch[0], val.mv_data, _pkBatch.size() * sizeof(uint64_t));
+
+                pcb((const uint64_t*)&_pkBatch[0], _pkBatch.size());
+
+                rc = mdb_cursor_get(_indexCursor, &key, &val, MDB_NEXT_MULTIPLE);
+            }
+
+            if(rc != MDB_NOTFOUND)
+                throw std::runtime_error(("Unable to read duplicates."));
 
-            return key.substr(runder_index+1);
+            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_GET_CURRENT) != 0)
+                _validIterator = false;
         }
 
+        // Returns the current row as JSON text. Binary rows are converted, so their fields come back in
+        // name order.
         std::string current_data() const
         {
             if(_closed)
@@ -214,23 +543,84 @@ public:
             if(!_validIterator)
                 throw std::runtime_error(("Invalid iterator!"));
 
-            MDB_val shimKey, shimVal;
+            auto row = _current_row();
 
-            if(_index.empty())
-            {
-                shimKey.mv_size = _shimKey.mv_size;
-                shimKey.mv_data = _shimKey.mv_data;
-            }
+            if(_codec)
+                return _codec->decode((const uint8_t*)row.mv_data, row.mv_size).dump();
+
+            return std::string((char*)row.mv_data, row.mv_size);
+        }
+
+        // Returns the current row as stored (JSON text, or a binary row), without copying it. See data_view
+        // for how long it's good for.
+        data_view current_data_view() const
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to current_data_view() on close()d iterators."));
+
+            if(!_validIterator)
+                throw std::runtime_error(("Invalid iterator!"));
+
+            auto row = _current_row();
+
+            return data_view((const uint8_t*)row.mv_data, row.mv_size, _generation);
+        }
+
+        // Returns the current key without copying it: the encoded index value (see utils.h) for index
+        // iterators, the native pk for pk iterators.
+        data_view current_key_view() const
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to current_key_view() on close()d iterators."));
+
+            if(!_validIterator)
+                throw std::runtime_error(("Invalid iterator!"));
+
+            return data_view((const uint8_t*)_shimKey.mv_data, _shimKey.mv_size, _generation);
+        }
+
+        // Returns one field of the current row, or null if the row doesn't have it. Binary rows decode
+        // just that field, JSON rows are parsed in full.
+        nlohmann::json current_field(const std::string& name) const
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to current_field() on close()d iterators."));
+
+            if(!_validIterator)
+                throw std::runtime_error(("Invalid iterator!"));
+
+            auto row = _current_row();
+
+            nlohmann::json val;
+
+            if(_codec)
+                _codec->field((const uint8_t*)row.mv_data, row.mv_size, name, val);
             else
             {
-                shimKey.mv_size = _shimVal.mv_size;
-                shimKey.mv_data = _shimVal.mv_data;
+                auto j = nlohmann::json::parse((const char*)row.mv_data, (const char*)row.mv_data + row.mv_size);
+                auto found = j.find(name);
+                if(found != j.end())
+                    val = *found;
             }
-    
-            if(mdb_get(_txn, _dbi, &shimKey, &shimVal) != 0)
-                throw std::runtime_error(("Unable to find data!"));
 
-            return std::string((char*)shimVal.mv_data, shimVal.mv_size);
+            return val;
+        }
+
+        // Returns the current row's include columns (as a JSON object) straight from a covering index
+        // entry, without touching the row. Include columns missing from the row are missing here too.
+        nlohmann::json current_index_payload() const
+        {
+            if(_closed)
+                throw std::runtime_error(("Unable to current_index_payload() on close()d iterators."));
+
+            if(!_validIterator)
+                throw std::runtime_error(("Invalid iterator!"));
+
+            if(!_covering)
+                throw std::runtime_error(("Unable to current_index_payload() on an index without include columns."));
+
+            return nlohmann::json::from_msgpack((const uint8_t*)_shimVal.mv_data + sizeof(uint64_t),
+                                                _shimVal.mv_size - sizeof(uint64_t));
         }
 
     private:
@@ -239,6 +629,10 @@ public:
             _validIterator = false;
             _closed = true;
 
+            // Moved from iterators have no generation.
+            if(_generation)
+                ++*_generation;
+
             if(_indexCursor)
             {
                 mdb_cursor_close(_indexCursor);
@@ -246,106 +640,342 @@ public:
             }
             if(_txn)
             {
-                mdb_txn_commit(_txn);
+                _db->_end_read(_txn);
                 _txn = NULL;
             }
         }
 
-        void _set_cursor(const std::string& key, const std::string& prefix)
+        // Returns the current row's (uncompressed) bytes, which are valid until the iterator moves.
+        MDB_val _current_row() const
+        {
+            MDB_val shimVal = _shimVal;
+
+            // A compressed row is only unpacked once per position, so views of it stay valid.
+            if(_compressed && _rowGeneration == *_generation)
+            {
+                shimVal.mv_size = _rowBuffer.size();
+                shimVal.mv_data = const_cast<char*>(_rowBuffer.data());
+                return shimVal;
+            }
+
+            if(!_index.empty())
+            {
+                auto pk = current_pk();
+
+                MDB_val shimKey;
+                shimKey.mv_size = sizeof(pk);
+                shimKey.mv_data = &pk;
+
+                if(mdb_get(_txn, _rowDbi, &shimKey, &shimVal) != 0)
+                    throw std::runtime_error(("Unable to find data!"));
+            }
+
+            shimVal = _row_payload(shimVal);
+
+            if(_compressed)
+            {
+                _rowBuffer = _db->_unpack_row(_txn, _tableName, shimVal);
+                _rowGeneration = *_generation;
+                shimVal.mv_size = _rowBuffer.size();
+                shimVal.mv_data = const_cast<char*>(_rowBuffer.data());
+            }
+
+            return shimVal;
+        }
+
+        static uint64_t _native_pk(const MDB_val& val)
+        {
+            if(val.mv_size != sizeof(uint64_t))
+                throw std::runtime_error(("Malformed primary key."));
+
+            uint64_t pk;
+            memcpy(&pk, val.mv_data, sizeof(pk));
+            return pk;
+        }
+
+        static uint64_t _covering_pk(const MDB_val& val)
+        {
+            if(val.mv_size < sizeof(uint64_t))
+                throw std::runtime_error(("Malformed covering index entry."));
+
+            auto p = (const uint8_t*)val.mv_data;
+            return decode_key_uint64(p, p + val.mv_size);
+        }
+
+        void _find_values(const nlohmann::json& vals)
+        {
+            if(_index.empty())
+                throw std::runtime_error(("pk iterators must find() a uint64_t pk."));
+
+            if(vals.size() > _types.size())
+                throw std::runtime_error(("Too many values for index."));
+
+            std::string key;
+            for(size_t i = 0; i < vals.size(); ++i)
+                _encode_value(key, _types[i], vals[i]);
+
+            _set_cursor(key);
+        }
+
+        // Our cursor is on a sub-database holding only our table or index, so reaching either end of it
+        // (or of a find_range() range) is the only way to run off the end of the iterator.
+
+        void _set_cursor(const std::string& key)
+        {
+            ++*_generation;
+            _range = false;
+
+            _shimKey.mv_size = key.length();
+            _shimKey.mv_data = const_cast<char*>(key.c_str());
+
+            _validIterator = (mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_SET_RANGE) == 0);
+        }
+
+        void _next_cursor()
+        {
+            ++*_generation;
+
+            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_NEXT) != 0 || (_range && !_in_range()))
+                _validIterator = false;
+        }
+
+        void _prev_cursor()
+        {
+            ++*_generation;
+
+            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_PREV) != 0 || (_range && !_in_range()))
+                _validIterator = false;
+        }
+
+        int _cursor_get(const std::string& key, MDB_cursor_op op)
         {
             _shimKey.mv_size = key.length();
             _shimKey.mv_data = const_cast<char*>(key.c_str());
 
-            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_SET_RANGE) == 0)
+            return mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, op);
+        }
+
+        std::string _bound_key(const nlohmann::json& bound) const
+        {
+            if(!_index.empty())
+                return json_database::_range_key(json_database::_index(_db->_table(_tableName), _index), bound);
+
+            if(!bound.is_number_integer())
+                throw std::runtime_error(("pk iterators must find_range() uint64_t pks."));
+
+            return _row_key(bound.get<uint64_t>());
+        }
+
+        // Turns key into the smallest key that sorts after every key beginning with it. Returns false if
+        // there isn't one.
+        bool _successor(std::string& key) const
+        {
+            if(_index.empty())
             {
-                auto ck = std::string((char*)_shimKey.mv_data, _shimKey.mv_size);
-                if(ck.compare(0, prefix.length(), prefix) == 0)
-                    _validIterator = true;
-                else _validIterator = false;
+                auto pk = _native_pk(_bound_val(key));
+                if(pk == std::numeric_limits<uint64_t>::max())
+                    return false;
+                key = _row_key(pk + 1);
+                return true;
             }
-            else _validIterator = false;            
+
+            while(!key.empty() && (uint8_t)key.back() == 0xFF)
+                key.pop_back();
+
+            if(key.empty())
+                return false;
+
+            key.back() = (char)((uint8_t)key.back() + 1);
+            return true;
+        }
+
+        static MDB_val _bound_val(const std::string& key)
+        {
+            MDB_val val;
+            val.mv_size = key.size();
+            val.mv_data = const_cast<char*>(key.data());
+            return val;
         }
 
-        void _next_cursor(const std::string& prefix)
+        // Compares our current key with a range bound. A key that begins with the bound (a bound may be
+        // just the leading values of a compound index) compares equal to it. pk keys are native integers
+        // so they're compared as such.
+        int _compare_bound(const std::string& bound) const
         {
-            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_NEXT) != MDB_NOTFOUND)
+            if(_index.empty())
             {
-                auto ck = std::string((char*)_shimKey.mv_data, _shimKey.mv_size);
-                if(ck.compare(0, prefix.length(), prefix) != 0)
-                    _validIterator = false;
+                auto pk = _native_pk(_shimKey), boundPk = _native_pk(_bound_val(bound));
+                return (pk < boundPk) ? -1 : (pk > boundPk) ? 1 : 0;
             }
-            else _validIterator = false;            
+
+            auto cmp = memcmp(_shimKey.mv_data, bound.data(), std::min(_shimKey.mv_size, bound.size()));
+            if(cmp != 0)
+                return cmp;
+
+            return (_shimKey.mv_size < bound.size()) ? -1 : 0;
         }
 
-        void _prev_cursor(const std::string& prefix)
+        bool _in_range() const
         {
-            if(mdb_cursor_get(_indexCursor, &_shimKey, &_shimVal, MDB_PREV) != MDB_NOTFOUND)
+            if(!_loOpen)
             {
-                auto ck = std::string((char*)_shimKey.mv_data, _shimKey.mv_size);
-                if(ck.compare(0, prefix.length(), prefix) != 0)
-                    _validIterator = false;
+                auto cmp = _compare_bound(_loKey);
+                if(cmp < 0 || (cmp == 0 && !_loInclusive))
+                    return false;
+            }
+
+            if(!_hiOpen)
+            {
+                auto cmp = _compare_bound(_hiKey);
+                if(cmp > 0 || (cmp == 0 && !_hiInclusive))
+                    return false;
             }
-            else _validIterator = false;            
+
+            return true;
         }
 
         const json_database* _db;
-        std::string _index;
+        std::vector<std::string> _index;
         std::string _tableName;
         MDB_txn* _txn;
         MDB_dbi _dbi;
+        std::vector<column_type> _types;
+        bool _covering;
+        const row_codec* _codec;
+        bool _compressed;
+        MDB_dbi _rowDbi;
         MDB_cursor* _indexCursor;
         bool _validIterator;
         MDB_val _shimKey;
         MDB_val _shimVal;
         bool _closed;
+        std::vector<uint64_t> _pkBatch;
+        mutable std::string _rowBuffer;
+
+        // Bumped whenever the cursor moves, so views can tell they're stale and _rowBuffer whether it
+        // holds the current row (_rowGeneration). Shared with our views so they outlive us safely.
+        std::shared_ptr<uint64_t> _generation;
+        mutable uint64_t _rowGeneration;
+
+        // Set by find_range(), encoded like the keys of our sub-database.
+        bool _range;
+        bool _loOpen;
+        bool _hiOpen;
+        bool _loInclusive;
+        bool _hiInclusive;
+        std::string _loKey;
+        std::string _hiKey;
     };
 
-    json_database(const std::string& fileName) :
+    // For periodic_sync, syncInterval is the longest we go between syncs and syncBytes how many row
+    // bytes may be committed before syncing early. LMDB can only nest transactions when the map isn't
+    // writable, so savepoints (see savepoint()) opens it read only and writes with write() instead of
+    // MDB_WRITEMAP (map_async then behaves like full).
+    json_database(const std::string& fileName,
+                  durability mode = durability::no_meta_sync,
+                  std::chrono::milliseconds syncInterval = std::chrono::milliseconds(1000),
+                  uint64_t syncBytes = 64 * 1024 * 1024,
+                  bool savepoints = false) :
         _env(NULL),
         _version(0),
         _schema(),
         _transacting(false),
-        _transLok()
+        _transLok(),
+        _pkCounters(),
+        _lastWriteTxnID(0),
+        _dictionaries(),
+        _dictionaryLok(),
+        _dictionaryIds(),
+        _pendingDictionaryIds(),
+        _committer(),
+        _commitLok(),
+        _commitCond(),
+        _commitQueue(),
+        _committerRunning(false),
+        _maxBatch(0),
+        _maxLinger(0),
+        _txnBytes(0),
+        _syncer(),
+        _syncLok(),
+        _syncCond(),
+        _syncerRunning(false),
+        _syncInterval(syncInterval),
+        _syncBytes(syncBytes),
+        _unsynced(false),
+        _skipsSyncs(mode == durability::periodic_sync || (mode == durability::map_async && !savepoints)),
+        _lastSync(std::chrono::steady_clock::now()),
+        _syncMetrics(),
+        _mapGrowth(2.0),
+        _mapMaxStep(1024 * 1024 * 1024),
+        _mapMaxSize(0),
+        _readersLok(),
+        _readersCond(),
+        _readers(0),
+        _resizing(false),
+        _expirer(),
+        _expiryLok(),
+        _expiryCond(),
+        _expiryStopping(false),
+        _expiryInterval(0),
+        _expiryBatchRows(0),
+        _savepoints(savepoints),
+        _savepointMapFull(false)
     {
         if(mdb_env_create(&_env) != 0)
             throw std::runtime_error(("Unable to create lmdb environment."));
 
-        if(mdb_env_open(_env, fileName.c_str(), MDB_NOSUBDIR | MDB_WRITEMAP | MDB_NOMETASYNC | MDB_NOTLS, 0644))
+        if(mdb_env_set_maxdbs(_env, TABLES_MAX_DBS) != 0)
+        {
+            _close();
+            throw std::runtime_error(("Unable to set max number of json_databases."));
+        }
+
+        if(mdb_env_open(_env, fileName.c_str(), MDB_NOSUBDIR | ((savepoints) ? 0 : MDB_WRITEMAP) | MDB_NOTLS | _durability_flags(mode), 0644))
+        {
+            _close();
             throw std::runtime_error(("Unable to open json_database environment."));
+        }
 
+        // Our sub-database handles are opened once, here, and stay valid until _env is closed.
         _transaction(_env, true, [this](trans_state& ts) {
 
-            _version = s_to_uint64(tables::_getByKey(ts.cursor, "database_version").second);
+            _version = s_to_uint64(tables::_getByKey(ts.cursor, _meta_key("database_version")).second);
 
-            auto tnj = nlohmann::json::parse(_getByKey(ts.cursor, "table_names").second);
+            auto tnj = nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("table_names")).second);
 
             for(auto tn : tnj)
             {
                 auto tableName = tn.get<std::string>();
 
-                table_info ti;
-                auto rcj = nlohmann::json::parse(_getByKey(ts.cursor, "regular_columns_" + tableName).second);
-                for(auto rc : rcj)
-                    ti.regular_columns.push_back(rc.get<std::string>());
-                auto icj = nlohmann::json::parse(_getByKey(ts.cursor, "index_columns_" + tableName).second);
-                for(auto ic : icj)
-                    ti.index_columns.push_back(ic.get<std::string>());
-
-                auto cij = nlohmann::json::parse(_getByKey(ts.cursor, "compound_indexes_" + tableName).second);
-                for(auto cic : cij)
-                {
-                    if(!cic.empty())
-                    {
-                        std::vector<std::string> idx;
-                        for(auto col : cic)
-                            idx.push_back(col.get<std::string>());
-                        ti.compound_indexes.push_back(idx);
-                    }
-                }
+                auto ti = _parse_table_info(nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("regular_columns_" + tableName)).second),
+                                            nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("index_columns_" + tableName)).second),
+                                            nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("compound_indexes_" + tableName)).second),
+                                            nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("column_types_" + tableName)).second),
+                                            nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("index_includes_" + tableName)).second),
+                                            _getByKey(ts.cursor, _meta_key("row_format_" + tableName)).second,
+                                            _getByKey(ts.cursor, _meta_key("compression_" + tableName)).second,
+                                            nlohmann::json::parse(_getByKey(ts.cursor, _meta_key("ttl_" + tableName)).second));
 
                 _schema[tableName] = ti;
             }
+
+            if(_dbi_count(_schema) > TABLES_MAX_DBS)
+                throw std::runtime_error(("Schema requires more sub-databases than TABLES_MAX_DBS."));
+
+            for(auto& t : _schema)
+                _open_dbis(ts.txn, t.first, t.second, 0);
+
+            _read_pk_counters(ts);
+
+            // A read transaction sees the last committed write, so our first write is this + 1.
+            _lastWriteTxnID = mdb_txn_id(ts.txn);
         });
+
+        if(mode == durability::periodic_sync)
+        {
+            _syncerRunning = true;
+            _syncer = std::thread(&json_database::_sync_loop, this);
+        }
     }
 
     json_database(const json_database&) = delete;
@@ -353,6 +983,9 @@ public:
 
     ~json_database() noexcept
     {
+        stop_expiry();
+        stop_group_commit();
+        _stop_syncer();
         _close();
     }
 
@@ -366,6 +999,47 @@ public:
                                 const std::string& schema,
                                 uint64_t version = 1)
     {
+        // [
+        //     {
+        //         "table_name": "segment_files",
+        //         "regular_columns": [ "sdp" ],
+        //         "index_columns": [ "start_time", "end_time", "segment_id" ]
+        //         "compound_indexes": [ [ "start_time", "segment_id" ] ],
+        //         "column_types": { "start_time": "timestamp", "end_time": "timestamp", "segment_id": "uuid" },
+        //         "index_includes": { "start_time": [ "end_time" ], "start_time,segment_id": [ "sdp" ] },
+        //         "row_format": "binary",
+        //         "compression": "lz",
+        //         "ttl": { "column": "start_time", "seconds": 604800 }
+        //     }
+        // ]
+        //
+        // column types are one of: string (the default), bytes, int64, uint64, double, timestamp or uuid.
+        // index_includes names an index by its columns joined with commas, and lists the columns to copy
+        // into that index's entries. Each entry (pk and included values) must fit in an LMDB key.
+        // row_format is json (the default, rows are stored as inserted) or binary (see row_codec.h).
+        // compression is none (the default) or lz (see compression.h and train_dictionary()).
+        // ttl expires rows once their value in column (an indexed timestamp) is seconds old (see expire()).
+
+        auto j = nlohmann::json::parse(schema);
+
+        std::map<std::string, table_info> tables;
+        for(auto table : j)
+        {
+            auto tableName = table["table_name"].get<std::string>();
+            tables[tableName] = _parse_table_info(_schema_member(table, "regular_columns"),
+                                                  _schema_member(table, "index_columns"),
+                                                  _schema_member(table, "compound_indexes"),
+                                                  _schema_member(table, "column_types", nlohmann::json::object()),
+                                                  _schema_member(table, "index_includes", nlohmann::json::object()),
+                                                  _schema_member(table, "row_format", "json").get<std::string>(),
+                                                  _schema_member(table, "compression", "none").get<std::string>(),
+                                                  _schema_member(table, "ttl", nlohmann::json::object()));
+        }
+
+        auto maxDBs = _dbi_count(tables);
+        if(maxDBs > TABLES_MAX_DBS)
+            throw std::runtime_error(("Schema requires more sub-databases than TABLES_MAX_DBS."));
+
         MDB_env* env = NULL;
         if(mdb_env_create(&env) != 0)
             throw std::runtime_error(("Unable to create lmdb environment."));
@@ -375,26 +1049,15 @@ public:
             if(mdb_env_set_mapsize(env, size) != 0)
                 throw std::runtime_error(("Unable to set mdb environment map size."));
 
-            if(mdb_env_set_maxdbs(env, 10) != 0)
+            if(mdb_env_set_maxdbs(env, (MDB_dbi)maxDBs) != 0)
                 throw std::runtime_error(("Unable to set max number of json_databases."));
 
             if(mdb_env_open(env, fileName.c_str(), MDB_NOSUBDIR | MDB_WRITEMAP | MDB_NOMETASYNC, 0644))
                 throw std::runtime_error(("Unable to open json_database environment."));
 
-            _transaction(env, false, [schema, version](trans_state& ts) {
+            _transaction(env, false, [&](trans_state& ts) {
 
-                _putByKey(ts.txn, ts.dbi, "database_version", uint64_to_s(version));
-
-                auto j = nlohmann::json::parse(schema);
-
-                // [
-                //     {
-                //         "table_name": "segment_files",
-                //         "regular_columns": [ "sdp" ],
-                //         "index_columns": [ "start_time", "end_time", "segment_id" ]
-                //         "compound_indexes": [ [ "start_time", "segment_id" ] ]
-                //     }
-                // ]
+                _putByKey(ts.txn, ts.dbi, _meta_key("database_version"), uint64_to_s(version));
 
                 auto tableNames = nlohmann::json::array({});
 
@@ -403,23 +1066,23 @@ public:
                     auto tableName = table["table_name"].get<std::string>();
                     tableNames.push_back(tableName);
 
-                    if(table.find("regular_columns") != table.end())
-                        _putByKey(ts.txn, ts.dbi, "regular_columns_" + tableName, table["regular_columns"].dump());
-                    else _putByKey(ts.txn, ts.dbi, "regular_columns_" + tableName, "[]");
+                    _putByKey(ts.txn, ts.dbi, _meta_key("regular_columns_" + tableName), _schema_member(table, "regular_columns").dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("index_columns_" + tableName), _schema_member(table, "index_columns").dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("compound_indexes_" + tableName), _schema_member(table, "compound_indexes").dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("column_types_" + tableName), _schema_member(table, "column_types", nlohmann::json::object()).dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("index_includes_" + tableName), _schema_member(table, "index_includes", nlohmann::json::object()).dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("row_format_" + tableName), _schema_member(table, "row_format", "json").get<std::string>());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("compression_" + tableName), _schema_member(table, "compression", "none").get<std::string>());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("ttl_" + tableName), _schema_member(table, "ttl", nlohmann::json::object()).dump());
+                    _putByKey(ts.txn, ts.dbi, _meta_key("dictionary_id_" + tableName), "0");
 
-                    if(table.find("index_columns") != table.end())
-                        _putByKey(ts.txn, ts.dbi, "index_columns_" + tableName, table["index_columns"].dump());
-                    else _putByKey(ts.txn, ts.dbi, "index_columns_" + tableName, "[]");
+                    _open_dbis(ts.txn, tableName, tables[tableName], MDB_CREATE);
 
-                    if(table.find("compound_indexes") != table.end())
-                        _putByKey(ts.txn, ts.dbi, "compound_indexes_" + tableName, table["compound_indexes"].dump());
-                    else _putByKey(ts.txn, ts.dbi, "compound_indexes_" + tableName, "[]");
-
-                    _putByKey(ts.txn, ts.dbi, "next_pri_key_id_" + tableName, "1");
-                    _putByKey(ts.txn, ts.dbi, "last_insert_id_" + tableName, "0");
+                    _putByKey(ts.txn, ts.dbi, _meta_key("next_pri_key_id_" + tableName), "1");
+                    _putByKey(ts.txn, ts.dbi, _meta_key("last_insert_id_" + tableName), "0");
                 }
 
-                _putByKey(ts.txn, ts.dbi, "table_names", tableNames.dump());
+                _putByKey(ts.txn, ts.dbi, _meta_key("table_names"), tableNames.dump());
             });
 
             mdb_env_close(env);
@@ -431,95 +1094,592 @@ public:
         }
     }
 
+    // If the map fills up (or another process has grown it) the transaction is rolled back, the map is
+    // resized (see set_map_growth()) and tcb is run again, so tcb may be called more than once.
     template<typename TRANSCB>
     void transaction(TRANSCB tcb)
     {
         std::unique_lock<std::recursive_mutex> g(_transLok);
 
-        _transaction(_env, false, [&](trans_state& ts){
-            _transacting = true;
-            tcb(ts);
-        });
+        size_t txnID = 0;
+        bool wrotePKs = false;
 
-        _transacting = false;
-    }
+        while(true)
+        {
+            try
+            {
+                _transaction(_env, false, [&](trans_state& ts){
+                    txnID = mdb_txn_id(ts.txn);
+                    _load_pk_counters(ts, txnID);
+
+                    _txnBytes = 0;
+                    _savepointMapFull = false;
+                    _pendingDictionaryIds.clear();
+
+                    _transacting = true;
+                    tcb(ts);
+
+                    // A savepoint that filled the map must still grow it, even if tcb caught the error.
+                    if(_savepointMapFull)
+                        throw map_size_error("Savepoint filled the map.");
+
+                    wrotePKs = _persist_pk_counters(ts);
+                });
+
+                break;
+            }
+            catch(map_size_error&)
+            {
+                _transacting = false;
+                _lastWriteTxnID = 0;
+
+                if(!_grow_map())
+                    throw;
+            }
+            catch(...)
+            {
+                // Our counters may have been advanced by the aborted transaction.
+                _transacting = false;
+                _lastWriteTxnID = 0;
+                throw;
+            }
+        }
+
+        _transacting = false;
+
+        // Dictionaries trained by this transaction are now the current ones.
+        for(auto& pdi : _pendingDictionaryIds)
+            _dictionaryIds[pdi.first] = pdi.second;
+        _pendingDictionaryIds.clear();
+
+        _committed(_txnBytes);
+
+        // Writing the counters guarantees our commit got txnID, so if the next write transaction is
+        // txnID + 1 nobody else has written in between and our counters are still current.
+        _lastWriteTxnID = (wrotePKs) ? txnID : 0;
+    }
+
+    // When a transaction fills the map it grows by factor (but by no more than maxStep bytes at a time),
+    // up to maxSize bytes (0 for no limit). A factor of 1 turns growth off.
+    void set_map_growth(double factor, uint64_t maxStep, uint64_t maxSize = 0)
+    {
+        if(factor < 1.0 || maxStep == 0)
+            throw std::runtime_error(("Invalid map growth."));
+
+        std::unique_lock<std::recursive_mutex> g(_transLok);
+
+        _mapGrowth = factor;
+        _mapMaxStep = maxStep;
+        _mapMaxSize = maxSize;
+    }
+
+    size_t map_size() const
+    {
+        MDB_envinfo info;
+        mdb_env_info(_env, &info);
+        return info.me_mapsize;
+    }
+
+    // Runs spcb(trans_state& ts) in a nested transaction. If spcb throws, only its writes are rolled back
+    // and the exception is rethrown for the caller to handle, after which the enclosing transaction
+    // carries on. Needs a json_database opened with savepoints.
+    template<typename SPCB>
+    void savepoint(trans_state& ts, SPCB spcb)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to savepoint() outside of a transaction."));
+
+        if(!_savepoints)
+            throw std::runtime_error(("Unable to savepoint() without opening with savepoints."));
+
+        auto pkCounters = _pkCounters;
+        auto txnBytes = _txnBytes;
+        auto pendingDictionaryIds = _pendingDictionaryIds;
+
+        trans_state child;
+        child.dbi = ts.dbi;
+
+        auto rollback = [&](){
+            if(child.cursor)
+                mdb_cursor_close(child.cursor);
+            if(child.txn)
+                mdb_txn_abort(child.txn);
+
+            _pkCounters = pkCounters;
+            _txnBytes = txnBytes;
+            _pendingDictionaryIds = pendingDictionaryIds;
+        };
+
+        try
+        {
+            _check_mdb(mdb_txn_begin(_env, ts.txn, 0, &child.txn), "Unable to begin savepoint.");
+
+            if(mdb_cursor_open(child.txn, child.dbi, &child.cursor) != 0)
+                throw std::runtime_error(("Unable to open cursor."));
+
+            spcb(child);
+
+            mdb_cursor_close(child.cursor);
+            child.cursor = NULL;
+
+            auto txn = child.txn;
+            child.txn = NULL;
+            _check_mdb(mdb_txn_commit(txn), "Unable to commit savepoint.");
+        }
+        catch(map_size_error&)
+        {
+            rollback();
+            _savepointMapFull = true;
+            throw;
+        }
+        catch(...)
+        {
+            rollback();
+            throw;
+        }
+    }
+
+    // Forces everything committed so far to disk. In periodic_sync mode the sync thread calls this for us.
+    void sync()
+    {
+        // Cleared up front so commits made during the sync still count, and given back if it fails.
+        uint64_t syncing;
+        {
+            std::unique_lock<std::mutex> g(_syncLok);
+            _unsynced = false;
+            syncing = _syncMetrics.unsynced_bytes;
+            _syncMetrics.unsynced_bytes = 0;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto err = mdb_env_sync(_env, 1);
+        auto end = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> g(_syncLok);
+
+        if(err != 0)
+        {
+            ++_syncMetrics.failed_syncs;
+            _syncMetrics.unsynced_bytes += syncing;
+            _unsynced = true;
+            throw std::runtime_error(("Unable to mdb_env_sync()."));
+        }
+
+        ++_syncMetrics.syncs;
+        _syncMetrics.last_sync_latency = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+        _syncMetrics.max_sync_latency = std::max(_syncMetrics.max_sync_latency, _syncMetrics.last_sync_latency);
+        _lastSync = end;
+    }
+
+    // Only explicit sync()s (and the sync thread's) are counted. since_last_sync is measured from when we
+    // were opened if there hasn't been one.
+    sync_metrics get_sync_metrics() const
+    {
+        std::unique_lock<std::mutex> g(_syncLok);
+
+        auto metrics = _syncMetrics;
+        metrics.since_last_sync = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _lastSync);
+
+        return metrics;
+    }
+
+    // Group commit
+    //
+    // Every transaction() is its own LMDB commit (and sync), and writers all wait their turn for LMDB's
+    // writer lock. Writes submit()'d instead are run by a writer thread that runs as many as are queued
+    // (up to maxBatch, waiting up to maxLinger after the first for more to arrive) in one transaction,
+    // so they share a single commit.
+
+    void start_group_commit(size_t maxBatch = 256, std::chrono::microseconds maxLinger = std::chrono::microseconds(1000))
+    {
+        std::unique_lock<std::mutex> g(_commitLok);
+
+        if(_committerRunning)
+            throw std::runtime_error(("Group commit already started."));
+
+        _maxBatch = std::max(maxBatch, (size_t)1);
+        _maxLinger = maxLinger;
+        _committerRunning = true;
+        _committer = std::thread(&json_database::_commit_loop, this);
+    }
+
+    // Commits whatever is still queued, then stops the writer thread.
+    void stop_group_commit()
+    {
+        std::thread committer;
+
+        {
+            std::unique_lock<std::mutex> g(_commitLok);
+            _committerRunning = false;
+            committer = std::move(_committer);
+        }
+
+        _commitCond.notify_all();
+
+        if(committer.joinable())
+            committer.join();
+    }
+
+    // Queues tcb(trans_state& ts) to run in the writer thread. The future is ready once tcb's writes have
+    // committed, or holds what tcb threw. With savepoints each write runs in its own savepoint, so a write
+    // that throws is rolled back alone. Otherwise its batch is rolled back and the batch's writes are each
+    // re-run in their own transaction, so one bad write doesn't fail the others, but it does mean a tcb
+    // can be called more than once. Waiting on the future from inside a tcb deadlocks.
+    template<typename TRANSCB>
+    std::future<void> submit(TRANSCB tcb)
+    {
+        std::unique_lock<std::mutex> g(_commitLok);
+
+        if(!_committerRunning)
+            throw std::runtime_error(("Unable to submit() without start_group_commit()."));
+
+        _commitQueue.emplace_back();
+        _commitQueue.back().tcb = tcb;
+        auto done = _commitQueue.back().done.get_future();
+
+        g.unlock();
+        _commitCond.notify_all();
+
+        return done;
+    }
 
     // Note: If you're wondering where you get the trans_state from the answer is via the transaction.
-    std::string insert_json(trans_state& ts, const std::string& tableName, const std::string& row)
+    uint64_t insert_json(trans_state& ts, const std::string& tableName, const std::string& row)
+    {
+        return insert_json(ts, tableName, (const uint8_t*)row.data(), row.size());
+    }
+
+    // Inserts size bytes of JSON from row (a network buffer, say) without copying it anywhere but into
+    // the database itself.
+    uint64_t insert_json(trans_state& ts, const std::string& tableName, const uint8_t* row, size_t size)
     {
         if(!_transacting)
             throw std::runtime_error(("Unable to insert_json() outside of a transaction."));
 
-        auto newID = _getByKey(ts.cursor, "next_pri_key_id_" + tableName).second;
-        _putByKey(ts.txn, ts.dbi, tableName + "_" + newID, row);
-        _putByKey(ts.txn, ts.dbi, "last_insert_id_" + tableName, newID);
+        const auto& ti = _table(tableName);
+
+        return _insert(ts, tableName, ti, _parse_row(ti, row, size), row, size);
+    }
+
+    // Inserts size bytes from src, which needn't be JSON. ecb(const std::string& colName, const uint8_t* src,
+    // size_t size) is called once for each index (and include) column and returns that column's value
+    // as a nlohmann::json (null if the row doesn't have it). The row is stored as is (compressed if the
+    // table is), so blobs can't go in binary row tables.
+    template<typename EXTCB>
+    uint64_t insert(trans_state& ts, const std::string& tableName, const uint8_t* src, size_t size, EXTCB ecb)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to insert() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
+
+        if(ti.binary_rows)
+            throw std::runtime_error(("Unable to insert() blobs into a binary row table."));
+
+        return _insert(ts, tableName, ti, _extract_fields(ti, src, size, ecb), src, size);
+    }
+
+    // Inserts rows with consecutive pks and returns the first and last of them ({0, 0} for no rows).
+    // Every row is encoded before anything is written, then the rows are appended to the table and
+    // each index's entries are put in key order, so each B-tree page is visited once.
+    std::pair<uint64_t, uint64_t> insert_json_batch(trans_state& ts, const std::string& tableName, const std::vector<std::string>& rows)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to insert_json_batch() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
 
-        _putByKey(ts.txn, ts.dbi, "next_pri_key_id_" + tableName, uint64_to_s(s_to_uint64(newID) + 1));
+        if(rows.empty())
+            return std::make_pair(0, 0);
 
-        auto ti = _schema[tableName];
+        auto firstID = _pkCounters[tableName].next_pk;
 
-        auto j = nlohmann::json::parse(row);
+        // Rows that are stored as is are copied straight from rows, others are encoded up front.
+        std::vector<std::string> encoded;
+        if(!_stored_as_is(ti))
+            encoded.reserve(rows.size());
 
-        for(auto indexName : ti.index_columns)
-            _putByKey(ts.txn, ts.dbi, "index_" + tableName + "_" + indexName + "_" + j[indexName].get<std::string>(), tableName + "_" + newID);
+        std::vector<std::string> footprints;
+        footprints.reserve(rows.size());
 
-        for(auto ci : ti.compound_indexes)
+        std::vector<std::vector<std::pair<std::string, std::string>>> indexEntries(ti.indexes.size());
+        for(auto& ie : indexEntries)
+            ie.reserve(rows.size());
+
+        for(size_t i = 0; i < rows.size(); ++i)
         {
-            std::string key = "index_" + tableName;
-            for(auto idx : ci)
-                key += "_" + idx;
-            for(auto idx : ci)
-                key += "_" + j[idx].get<std::string>();
-            _putByKey(ts.txn, ts.dbi, key, tableName + "_" + newID);
+            auto j = _parse_row(ti, (const uint8_t*)rows[i].data(), rows[i].size());
+
+            auto entries = _index_entries(ti, firstID + i, j);
+            footprints.push_back(_footprint(ti, entries));
+
+            for(size_t ii = 0; ii < entries.size(); ++ii)
+                indexEntries[ii].push_back(std::make_pair(std::move(entries[ii].key), std::move(entries[ii].data)));
+
+            if(!_stored_as_is(ti))
+                encoded.push_back(_stored_row(ts, tableName, ti, j, (const uint8_t*)rows[i].data(), rows[i].size()));
         }
 
-        return newID;
+        _allocate_pks(tableName, rows.size());
+
+        for(size_t i = 0; i < rows.size(); ++i)
+        {
+            const auto& data = (_stored_as_is(ti)) ? rows[i] : encoded[i];
+            _append_row(ts, ti, firstID + i, footprints[i], (const uint8_t*)data.data(), data.size());
+            _txnBytes += data.size();
+        }
+
+        auto lastID = firstID + rows.size() - 1;
+        _pkCounters[tableName].last_insert_id = lastID;
+
+        // A stable sort keeps the pks of equal keys in pk order, which is their order in the index.
+        for(size_t ii = 0; ii < indexEntries.size(); ++ii)
+        {
+            auto& entries = indexEntries[ii];
+
+            std::stable_sort(entries.begin(), entries.end(), [](const std::pair<std::string, std::string>& a, const std::pair<std::string, std::string>& b){
+                return a.first < b.first;
+            });
+
+            for(auto& e : entries)
+                _putByKey(ts.txn, ti.indexes[ii].dbi, e.first, e.second);
+        }
+
+        return std::make_pair(firstID, lastID);
     }
 
-    void remove(trans_state& ts, const std::string& tableName, const std::string& pk)
+    // Loads newline separated JSON rows from source into an empty table (typically of a database fresh
+    // from create_database()) and returns how many rows were loaded. Rows are appended as they're read,
+    // while each index's entries are sorted externally (in runs of about runBytes, spilled to temporary
+    // files) and then appended to the index in order (MDB_APPEND and MDB_APPENDDUP), so no tree is ever
+    // written out of order.
+    static uint64_t bulk_load(const std::string& fileName,
+                              const std::string& tableName,
+                              std::istream& source,
+                              size_t runBytes = 64 * 1024 * 1024)
     {
-        if(!_transacting)
-            throw std::runtime_error(("Unable to remove() outside of a transaction."));
+        json_database db(fileName);
+
+        const auto& ti = db._table(tableName);
+
+        {
+            auto txn = db._begin_read();
+
+            MDB_stat st;
+            auto rc = mdb_stat(txn, ti.dbi, &st);
+
+            db._end_read(txn);
+
+            if(rc != 0 || st.ms_entries != 0)
+                throw std::runtime_error(("bulk_load() requires an empty table."));
+        }
+
+        std::vector<bulk_runs> runs(ti.indexes.size());
 
-        auto rowj = nlohmann::json::parse(_getByKey(ts.cursor, tableName + "_" + pk).second);
+        const size_t rowsPerTransaction = 10000;
 
-        // Remove any rows in any indexes that are pointing at our row...
-        for(auto ic : _schema[tableName].index_columns)
+        uint64_t count = 0;
+        std::string line;
+        std::vector<std::string> lines;
+        std::vector<std::vector<index_entry>> batchEntries;
+        bool more = true;
+
+        // transaction() re-runs its callback after growing the map, so each batch is read before its
+        // transaction and only handed to runs once it has committed.
+        while(more)
         {
-            auto key = "index_" + tableName + "_" + ic + "_" + rowj[ic].get<std::string>();
-            _removeByKey(ts.txn, ts.dbi, key);
+            lines.clear();
+            while(lines.size() < rowsPerTransaction && (more = (bool)std::getline(source, line)))
+            {
+                if(line.find_first_not_of(" \t\r") != std::string::npos)
+                    lines.push_back(std::move(line));
+            }
+
+            db.transaction([&](trans_state& ts){
+                batchEntries.clear();
+
+                for(auto& l : lines)
+                {
+                    auto j = _parse_row(ti, (const uint8_t*)l.data(), l.size());
+                    auto pk = db._pkCounters[tableName].next_pk;
+
+                    auto entries = _index_entries(ti, pk, j);
+                    auto footprint = _footprint(ti, entries);
+
+                    // Rows stored as is are appended straight from the line.
+                    std::string stored;
+                    auto data = (const uint8_t*)l.data();
+                    auto size = l.size();
+
+                    if(!_stored_as_is(ti))
+                    {
+                        stored = db._stored_row(ts, tableName, ti, j, data, size);
+                        data = (const uint8_t*)stored.data();
+                        size = stored.size();
+                    }
+
+                    db._allocate_pks(tableName, 1);
+                    _append_row(ts, ti, pk, footprint, data, size);
+                    db._pkCounters[tableName].last_insert_id = pk;
+
+                    batchEntries.push_back(std::move(entries));
+                }
+            });
+
+            for(auto& entries : batchEntries)
+            {
+                for(size_t ii = 0; ii < entries.size(); ++ii)
+                    runs[ii].add(entries[ii].key, entries[ii].data, runBytes);
+            }
+
+            count += lines.size();
         }
 
-        // Remove any rows in any compound index that is pointing at our row...
-        for(auto ci : _schema[tableName].compound_indexes)
+        std::vector<std::pair<std::string, std::string>> batch;
+
+        for(size_t ii = 0; ii < ti.indexes.size(); ++ii)
         {
-            std::string colNames, colVals;
-            for(auto cp : ci)
+            auto dbi = ti.indexes[ii].dbi;
+
+            bulk_merge merge(runs[ii]);
+
+            // Index keys are never empty.
+            std::string lastKey;
+
+            while(!merge.done())
             {
-                colNames += "_" + cp;
-                colVals += "_" + rowj[cp].get<std::string>();
+                // Like the rows, merged entries are taken before the transaction so it can be re-run.
+                batch.clear();
+                for(size_t n = 0; n < rowsPerTransaction && !merge.done(); ++n)
+                {
+                    batch.push_back(std::make_pair(merge.key(), merge.data()));
+                    merge.next();
+                }
+
+                // A new key is appended with MDB_APPEND (so full pages split as appends rather than in half),
+                // another pk for the last key with MDB_APPENDDUP.
+                db.transaction([&](trans_state& ts){
+                    auto prev = &lastKey;
+                    for(auto& e : batch)
+                    {
+                        _putByKey(ts.txn, dbi, e.first, e.second, (e.first == *prev) ? MDB_APPENDDUP : MDB_APPEND);
+                        prev = &e.first;
+                    }
+                });
+
+                lastKey = batch.back().first;
             }
+        }
+
+        return count;
+    }
+
+    // Replaces row pk with row, keeping its pk. Only the index entries whose keys (or covering index
+    // payloads) differ between the old and new rows are rewritten.
+    void update_json(trans_state& ts, const std::string& tableName, uint64_t pk, const std::string& row)
+    {
+        update_json(ts, tableName, pk, (const uint8_t*)row.data(), row.size());
+    }
+
+    void update_json(trans_state& ts, const std::string& tableName, uint64_t pk, const uint8_t* row, size_t size)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to update_json() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
+
+        _update(ts, tableName, ti, pk, _parse_row(ti, row, size), row, size);
+    }
+
+    void remove(trans_state& ts, const std::string& tableName, uint64_t pk)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to remove() outside of a transaction."));
+
+        _remove(ts, _table(tableName), pk);
+    }
+
+    // Removes every row whose value in index is >= lo and < hi, returning how many were removed. On a
+    // compound index lo and hi may be arrays of leading values. A null bound (or an empty array) leaves
+    // that end open, like find_range(). The index is walked once with a cursor, deleting as it goes,
+    // then the rows and their other index entries are deleted in key order.
+    uint64_t remove_range(trans_state& ts, const std::string& tableName, const std::vector<std::string>& index, const nlohmann::json& lo, const nlohmann::json& hi)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to remove_range() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
+        const auto& ii = _index(ti, index);
+
+        return _remove_range(ts, ti, ii, _range_key(ii, lo), _range_key(ii, hi), std::numeric_limits<size_t>::max());
+    }
+
+    uint64_t remove_range(trans_state& ts, const std::string& tableName, const std::string& index, const nlohmann::json& lo, const nlohmann::json& hi)
+    {
+        return remove_range(ts, tableName, std::vector<std::string>{index}, lo, hi);
+    }
+
+    // Removes every row of a table (and its index entries) by emptying its sub-databases, without
+    // visiting the rows. pks keep counting up from where they were.
+    void truncate(trans_state& ts, const std::string& tableName)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to truncate() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
+
+        _check_mdb(mdb_drop(ts.txn, ti.dbi, 0), "Unable to mdb_drop() " + tableName);
+
+        for(auto& ii : ti.indexes)
+            _check_mdb(mdb_drop(ts.txn, ii.dbi, 0), "Unable to mdb_drop() " + tableName);
+    }
+
+    // Removes the rows of a table with a ttl that have expired, oldest first, in transactions of about
+    // batchRows rows each so no other writer waits long. Returns how many rows were removed.
+    uint64_t expire(const std::string& tableName, size_t batchRows = 1000)
+    {
+        return _expire(tableName, batchRows, NULL);
+    }
+
+    // Starts a thread that expire()s every table with a ttl every interval.
+    void start_expiry(std::chrono::milliseconds interval = std::chrono::milliseconds(60000), size_t batchRows = 1000)
+    {
+        std::unique_lock<std::mutex> g(_expiryLok);
+
+        if(_expirer.joinable())
+            throw std::runtime_error(("Expiry already started."));
+
+        _expiryInterval = interval;
+        _expiryBatchRows = batchRows;
+        _expiryStopping = false;
+        _expirer = std::thread(&json_database::_expiry_loop, this);
+    }
 
-            auto key = "index_" + tableName + colNames + colVals;
+    // Stops the expiry thread, after the batch it's on (if any).
+    void stop_expiry()
+    {
+        std::thread expirer;
 
-            _removeByKey(ts.txn, ts.dbi, "index_" + tableName + colNames + colVals);
+        {
+            std::unique_lock<std::mutex> g(_expiryLok);
+            _expiryStopping = true;
+            expirer = std::move(_expirer);
         }
 
-        // Finally, remove our data row...
-        _removeByKey(ts.txn, ts.dbi, tableName + "_" + pk);
+        _expiryCond.notify_all();
+
+        if(expirer.joinable())
+            expirer.join();
     }
-    
+
     iterator get_iterator(const std::string& tableName, const std::vector<std::string>& indexes)
     {
-        std::string indexKey;
-        for(auto idx : indexes)
-            indexKey += "_" + idx;
-        return iterator(this, tableName, indexKey);
+        return iterator(this, tableName, indexes);
     }
 
     iterator get_iterator(const std::string& tableName, const std::string& index)
     {
-        return iterator(this, tableName, "_" + index);
+        return iterator(this, tableName, std::vector<std::string>{index});
     }
 
     iterator get_pk_iterator(const std::string& tableName)
@@ -527,6 +1687,105 @@ public:
         return iterator(this, tableName);
     }
 
+    // Trains a dictionary from (up to) the sampleRows most recent rows of a compressed table and makes
+    // it the dictionary new rows are compressed with. Existing rows keep the dictionary they were
+    // compressed with. Returns the size of the new dictionary (0 if there was nothing to learn from, in
+    // which case the current dictionary is kept).
+    size_t train_dictionary(trans_state& ts, const std::string& tableName, size_t maxSize = 16384, size_t sampleRows = 1000)
+    {
+        if(!_transacting)
+            throw std::runtime_error(("Unable to train_dictionary() outside of a transaction."));
+
+        const auto& ti = _table(tableName);
+
+        if(!ti.compressed)
+            throw std::runtime_error(("Unable to train_dictionary() for an uncompressed table."));
+
+        std::vector<std::string> samples;
+
+        MDB_cursor* cursor;
+        if(mdb_cursor_open(ts.txn, ti.dbi, &cursor) != 0)
+            throw std::runtime_error(("Unable to open cursor."));
+
+        try
+        {
+            MDB_val key, val;
+            auto rc = mdb_cursor_get(cursor, &key, &val, MDB_LAST);
+            while(rc == 0 && samples.size() < sampleRows)
+            {
+                samples.push_back(_unpack_row(ts.txn, tableName, _row_payload(val)));
+                rc = mdb_cursor_get(cursor, &key, &val, MDB_PREV);
+            }
+        }
+        catch(...)
+        {
+            mdb_cursor_close(cursor);
+            throw;
+        }
+
+        mdb_cursor_close(cursor);
+
+        auto dictionary = lz_train_dictionary(samples, maxSize);
+        if(dictionary.empty())
+            return 0;
+
+        // Dictionaries are identified by a hash of their contents, so an id always means the same
+        // dictionary even across aborted transactions and other processes.
+        auto id = _dictionary_id(dictionary);
+
+        _putByKey(ts.txn, ts.dbi, _meta_key("dictionary_" + tableName + "_" + uint64_to_s(id)), dictionary);
+        _putByKey(ts.txn, ts.dbi, _meta_key("dictionary_id_" + tableName), uint64_to_s(id));
+
+        // New rows switch to it once we commit (see _current_dictionary_id()).
+        _pendingDictionaryIds[tableName] = id;
+
+        return dictionary.size();
+    }
+
+    // Scans a table's rows. Only the row headers are read so this doesn't decompress anything.
+    table_stats stats(const std::string& tableName) const
+    {
+        const auto& ti = _table(tableName);
+
+        table_stats stats;
+
+        auto txn = _begin_read();
+
+        MDB_cursor* cursor;
+        if(mdb_cursor_open(txn, ti.dbi, &cursor) != 0)
+        {
+            _end_read(txn);
+            throw std::runtime_error(("Unable to open cursor."));
+        }
+
+        try
+        {
+            MDB_val key, val;
+            auto rc = mdb_cursor_get(cursor, &key, &val, MDB_FIRST);
+            while(rc == 0)
+            {
+                auto payload = _row_payload(val);
+
+                ++stats.rows;
+                stats.stored_bytes += payload.mv_size;
+                stats.data_bytes += (ti.compressed) ? _row_header(payload).rawSize : payload.mv_size;
+
+                rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+            }
+        }
+        catch(...)
+        {
+            mdb_cursor_close(cursor);
+            _end_read(txn);
+            throw;
+        }
+
+        mdb_cursor_close(cursor);
+        _end_read(txn);
+
+        return stats;
+    }
+
 private:
     void _close() noexcept
     {
@@ -537,11 +1796,1492 @@ private:
         }
     }
 
+    // Layout
+    //
+    // Each table's rows (each behind its index footprint, see below) live in a sub-database named
+    // "table:<table>" keyed by pk, and each index in one named "index:<table>:<col>[,<col>...]" mapping
+    // the index values to the pks of the rows with those values. pks are native uint64_t's (tables are
+    // MDB_INTEGERKEY) and indexes store each distinct value once with its pks as sorted fixed size
+    // duplicates (MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP). Covering indexes instead store a big
+    // endian pk (so duplicates still sort by pk) followed by the msgpack'd include columns. Index keys use
+    // the order preserving encodings from utils.h so memcmp() order matches value order. Our metadata
+    // lives in the main (unnamed) database next to the sub-database names (which LMDB stores there), so
+    // metadata keys start with a 0 byte to keep them from ever colliding with a sub-database name.
+
+    static std::string _meta_key(const std::string& name)
+    {
+        return std::string(1, '\0') + name;
+    }
+
+    static nlohmann::json _schema_member(const nlohmann::json& table,
+                                         const std::string& name,
+                                         const nlohmann::json& defaultVal = nlohmann::json::array({}))
+    {
+        return (table.find(name) != table.end()) ? table[name] : defaultVal;
+    }
+
+    static column_type _parse_column_type(const std::string& name)
+    {
+        static const std::map<std::string, column_type> types = {
+            { "string", column_type::STRING },
+            { "bytes", column_type::BYTES },
+            { "int64", column_type::INT64 },
+            { "uint64", column_type::UINT64 },
+            { "double", column_type::DOUBLE },
+            { "timestamp", column_type::TIMESTAMP },
+            { "uuid", column_type::UUID }
+        };
+
+        auto found = types.find(name);
+        if(found == types.end())
+            throw std::runtime_error(("Unknown column type: " + name));
+
+        return found->second;
+    }
+
+    static table_info _parse_table_info(const nlohmann::json& rcj,
+                                        const nlohmann::json& icj,
+                                        const nlohmann::json& cij,
+                                        const nlohmann::json& ctj,
+                                        const nlohmann::json& iij,
+                                        const std::string& rowFormat,
+                                        const std::string& compression,
+                                        const nlohmann::json& ttlj)
+    {
+        table_info ti;
+
+        for(auto it = ctj.begin(); it != ctj.end(); ++it)
+            ti.column_types[it.key()] = _parse_column_type(it.value().get<std::string>());
+
+        for(auto rc : rcj)
+            ti.regular_columns.push_back(rc.get<std::string>());
+
+        for(auto ic : icj)
+            ti.index_columns.push_back(ic.get<std::string>());
+
+        for(auto cic : cij)
+        {
+            if(!cic.empty())
+            {
+                std::vector<std::string> idx;
+                for(auto col : cic)
+                    idx.push_back(col.get<std::string>());
+                ti.compound_indexes.push_back(idx);
+            }
+        }
+
+        for(auto& ic : ti.index_columns)
+        {
+            index_info ii;
+            ii.columns.push_back(ic);
+            ti.indexes.push_back(ii);
+        }
+
+        for(auto& ci : ti.compound_indexes)
+        {
+            index_info ii;
+            ii.columns = ci;
+            ti.indexes.push_back(ii);
+        }
+
+        for(auto& ii : ti.indexes)
+        {
+            for(auto& col : ii.columns)
+            {
+                auto found = ti.column_types.find(col);
+                ii.types.push_back((found != ti.column_types.end()) ? found->second : column_type::STRING);
+            }
+
+            auto found = iij.find(_index_name(ii.columns));
+            if(found != iij.end())
+            {
+                for(auto col : *found)
+                    ii.include.push_back(col.get<std::string>());
+            }
+        }
+
+        for(auto it = iij.begin(); it != iij.end(); ++it)
+        {
+            auto found = std::find_if(ti.indexes.begin(), ti.indexes.end(), [&](const index_info& ii){
+                return _index_name(ii.columns) == it.key();
+            });
+
+            if(found == ti.indexes.end())
+                throw std::runtime_error(("index_includes names an unknown index: " + it.key()));
+        }
+
+        std::vector<std::string> indexed;
+        for(auto& ii : ti.indexes)
+        {
+            for(auto& col : ii.columns)
+                indexed.push_back(col);
+            for(auto& col : ii.include)
+                indexed.push_back(col);
+        }
+
+        std::sort(indexed.begin(), indexed.end());
+        indexed.erase(std::unique(indexed.begin(), indexed.end()), indexed.end());
+
+        ti.extractor = json_extractor(indexed);
+
+        if(rowFormat == "binary")
+        {
+            // Every column the schema mentions gets interned, in a fixed order so ids are stable.
+            std::vector<std::string> columns;
+            auto intern = [&](const std::string& col) {
+                if(std::find(columns.begin(), columns.end(), col) == columns.end())
+                    columns.push_back(col);
+            };
+
+            for(auto& col : ti.regular_columns)
+                intern(col);
+            for(auto& ii : ti.indexes)
+            {
+                for(auto& col : ii.columns)
+                    intern(col);
+                for(auto& col : ii.include)
+                    intern(col);
+            }
+            for(auto& ct : ti.column_types)
+                intern(ct.first);
+
+            ti.binary_rows = true;
+            ti.codec = row_codec(columns);
+        }
+        else if(rowFormat != "json")
+            throw std::runtime_error(("Unknown row format: " + rowFormat));
+
+        if(compression == "lz")
+            ti.compressed = true;
+        else if(compression != "none")
+            throw std::runtime_error(("Unknown compression: " + compression));
+
+        if(!ttlj.empty())
+        {
+            auto column = ttlj.at("column").get<std::string>();
+
+            for(size_t i = 0; i < ti.indexes.size(); ++i)
+            {
+                if(ti.indexes[i].columns == std::vector<std::string>{column} && ti.indexes[i].types[0] == column_type::TIMESTAMP)
+                    ti.ttl_index = (int)i;
+            }
+
+            if(ti.ttl_index < 0)
+                throw std::runtime_error(("ttl column must be an indexed timestamp: " + column));
+
+            ti.ttl_ms = ttlj.at("seconds").get<int64_t>() * 1000;
+        }
+
+        return ti;
+    }
+
+    static int64_t _to_int64(const nlohmann::json& val)
+    {
+        if(val.is_number())
+            return val.get<int64_t>();
+        if(val.is_string())
+            return std::stoll(val.get<std::string>());
+        throw std::runtime_error(("Expected an integer value."));
+    }
+
+    static uint64_t _to_uint64(const nlohmann::json& val)
+    {
+        if(val.is_number_unsigned())
+            return val.get<uint64_t>();
+        if(val.is_string())
+            return std::stoull(val.get<std::string>());
+        throw std::runtime_error(("Expected an unsigned integer value."));
+    }
+
+    static double _to_double(const nlohmann::json& val)
+    {
+        if(val.is_number())
+            return val.get<double>();
+        if(val.is_string())
+            return std::stod(val.get<std::string>());
+        throw std::runtime_error(("Expected a numeric value."));
+    }
+
+    static std::string _to_string(const nlohmann::json& val)
+    {
+        if(val.is_string())
+            return val.get<std::string>();
+        if(val.is_number())
+            return val.dump();
+        throw std::runtime_error(("Expected a string value."));
+    }
+
+    // Appends the order preserving encoding of val, converted to type, to key.
+    static void _encode_value(std::string& key, column_type type, const nlohmann::json& val)
+    {
+        switch(type)
+        {
+        case column_type::STRING:
+            encode_key_string(key, _to_string(val));
+            break;
+        case column_type::BYTES:
+            encode_key_hex_bytes(key, _to_string(val));
+            break;
+        case column_type::INT64:
+        case column_type::TIMESTAMP:
+            encode_key_int64(key, _to_int64(val));
+            break;
+        case column_type::UINT64:
+            encode_key_uint64(key, _to_uint64(val));
+            break;
+        case column_type::DOUBLE:
+            encode_key_double(key, _to_double(val));
+            break;
+        case column_type::UUID:
+            encode_key_uuid(key, _to_string(val));
+            break;
+        }
+    }
+
+    static size_t _dbi_count(const std::map<std::string, table_info>& schema)
+    {
+        size_t count = 0;
+        for(auto& t : schema)
+            count += 1 + t.second.indexes.size();
+        return count;
+    }
+
+    static void _open_dbi(MDB_txn* txn, const std::string& name, unsigned int flags, MDB_dbi& dbi)
+    {
+        if(mdb_dbi_open(txn, name.c_str(), flags, &dbi) != 0)
+            throw std::runtime_error(("Unable to open sub-database " + name));
+    }
+
+    static std::string _index_name(const std::vector<std::string>& columns)
+    {
+        std::string name;
+        for(size_t i = 0; i < columns.size(); ++i)
+            name += ((i > 0)?",":"") + columns[i];
+        return name;
+    }
+
+    static void _open_dbis(MDB_txn* txn, const std::string& tableName, table_info& ti, unsigned int flags)
+    {
+        _open_dbi(txn, "table:" + tableName, MDB_INTEGERKEY | flags, ti.dbi);
+
+        for(auto& ii : ti.indexes)
+        {
+            // Covering index entries vary in size so they can't be MDB_DUPFIXED.
+            auto indexFlags = (ii.include.empty()) ? MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP : MDB_DUPSORT;
+
+            _open_dbi(txn, "index:" + tableName + ":" + _index_name(ii.columns), indexFlags | flags, ii.dbi);
+        }
+    }
+
+    const table_info& _table(const std::string& tableName) const
+    {
+        auto found = _schema.find(tableName);
+        if(found == _schema.end())
+            throw std::runtime_error(("Unknown table: " + tableName));
+        return found->second;
+    }
+
+    static const index_info& _index(const table_info& ti, const std::vector<std::string>& columns)
+    {
+        // Single column indexes win over a compound index with the same single column.
+        for(auto& ii : ti.indexes)
+        {
+            if(ii.columns == columns)
+                return ii;
+        }
+
+        throw std::runtime_error(("Unknown index."));
+    }
+
+    // Returns the sub-database holding the given index, or the table's rows if index is empty.
+    MDB_dbi _index_dbi(const std::string& tableName, const std::vector<std::string>& index) const
+    {
+        const auto& ti = _table(tableName);
+        return (index.empty()) ? ti.dbi : _index(ti, index).dbi;
+    }
+
+    static std::string _row_key(uint64_t pk)
+    {
+        return std::string((const char*)&pk, sizeof(pk));
+    }
+
+    struct index_entry
+    {
+        MDB_dbi dbi;
+        std::string key;
+        std::string data;
+    };
+
+    // Returns the data for row j's entry in ii: its pk, plus the include columns for covering indexes.
+    static std::string _index_data(const index_info& ii, uint64_t pk, const nlohmann::json& j)
+    {
+        if(ii.include.empty())
+            return _row_key(pk);
+
+        std::string data;
+        encode_key_uint64(data, pk);
+
+        auto payload = nlohmann::json::object();
+        for(auto& col : ii.include)
+        {
+            auto found = j.find(col);
+            if(found != j.end())
+                payload[col] = *found;
+        }
+
+        nlohmann::json::to_msgpack(payload, data);
+
+        if(data.length() > 511)
+            throw std::runtime_error(("Covering index entry too large for LMDB."));
+
+        return data;
+    }
+
+    // pk allocation
+    //
+    // Each table's next pk and last inserted pk are kept in memory and written to the metadata once, at
+    // the end of each transaction that changed them. They're only re-read when some other writer (another
+    // json_database, maybe in another process) may have committed since our last write.
+
+    struct pk_counters
+    {
+        uint64_t next_pk {1};
+        uint64_t last_insert_id {0};
+        uint64_t persisted_next_pk {1};
+    };
+
+    void _read_pk_counters(trans_state& ts)
+    {
+        for(auto& t : _schema)
+        {
+            auto& pc = _pkCounters[t.first];
+            pc.next_pk = s_to_uint64(_getByKey(ts.cursor, _meta_key("next_pri_key_id_" + t.first)).second);
+            pc.last_insert_id = s_to_uint64(_getByKey(ts.cursor, _meta_key("last_insert_id_" + t.first)).second);
+            pc.persisted_next_pk = pc.next_pk;
+        }
+    }
+
+    // The current dictionary ids are cached the same way, so they're dropped along with the counters.
+    void _load_pk_counters(trans_state& ts, size_t txnID)
+    {
+        if(_lastWriteTxnID == 0 || txnID != _lastWriteTxnID + 1)
+        {
+            _read_pk_counters(ts);
+            _dictionaryIds.clear();
+        }
+    }
+
+    bool _persist_pk_counters(trans_state& ts)
+    {
+        bool wrote = false;
+
+        for(auto& pcp : _pkCounters)
+        {
+            auto& pc = pcp.second;
+            if(pc.next_pk != pc.persisted_next_pk)
+            {
+                _putByKey(ts.txn, ts.dbi, _meta_key("next_pri_key_id_" + pcp.first), uint64_to_s(pc.next_pk));
+                _putByKey(ts.txn, ts.dbi, _meta_key("last_insert_id_" + pcp.first), uint64_to_s(pc.last_insert_id));
+                pc.persisted_next_pk = pc.next_pk;
+                wrote = true;
+            }
+        }
+
+        return wrote;
+    }
+
+    // Reserves count consecutive pks and returns the first.
+    uint64_t _allocate_pks(const std::string& tableName, uint64_t count)
+    {
+        auto& pc = _pkCounters[tableName];
+        auto first = pc.next_pk;
+        pc.next_pk += count;
+        return first;
+    }
+
+    // Compressed tables store each row behind a small header: a format byte (0 for rows stored as is
+    // because compressing didn't help, 1 for lz), then for lz rows varints holding the dictionary id (0
+    // for none) and the uncompressed size.
+    struct row_header
+    {
+        uint8_t format;
+        uint64_t dictionaryId;
+        uint64_t rawSize;
+        const uint8_t* body;
+        size_t bodySize;
+    };
+
+    static row_header _row_header(const MDB_val& val)
+    {
+        auto p = (const uint8_t*)val.mv_data;
+        auto end = p + val.mv_size;
+
+        if(p == end)
+            throw std::runtime_error(("Malformed compressed row."));
+
+        row_header rh {*p++, 0, 0, NULL, 0};
+
+        if(rh.format == 1)
+        {
+            rh.dictionaryId = decode_varint(p, end);
+            rh.rawSize = decode_varint(p, end);
+        }
+        else if(rh.format == 0)
+            rh.rawSize = end - p;
+        else throw std::runtime_error(("Unknown compressed row format."));
+
+        rh.body = p;
+        rh.bodySize = end - p;
+
+        return rh;
+    }
+
+    static uint64_t _dictionary_id(const std::string& dictionary)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for(auto c : dictionary)
+        {
+            h ^= (uint8_t)c;
+            h *= 1099511628211ULL;
+        }
+        return (h == 0) ? 1 : h;
+    }
+
+    // Dictionaries are immutable once written so they're cached for the life of the json_database.
+    const std::string& _dictionary(MDB_txn* txn, const std::string& tableName, uint64_t id) const
+    {
+        auto name = "dictionary_" + tableName + "_" + uint64_to_s(id);
+
+        std::unique_lock<std::mutex> g(_dictionaryLok);
+
+        auto found = _dictionaries.find(name);
+        if(found != _dictionaries.end())
+            return found->second;
+
+        MDB_dbi dbi;
+        if(mdb_dbi_open(txn, NULL, 0, &dbi) != 0)
+            throw std::runtime_error(("Unable to open main database."));
+
+        return _dictionaries[name] = _getByKey(txn, dbi, _meta_key(name)).second;
+    }
+
+    // Returns the id of the dictionary new rows are compressed with: one trained earlier in this
+    // transaction, else the committed one (read once, then cached until train_dictionary() commits or
+    // another writer may have changed it).
+    uint64_t _current_dictionary_id(trans_state& ts, const std::string& tableName) const
+    {
+        auto pending = _pendingDictionaryIds.find(tableName);
+        if(pending != _pendingDictionaryIds.end())
+            return pending->second;
+
+        auto found = _dictionaryIds.find(tableName);
+        if(found != _dictionaryIds.end())
+            return found->second;
+
+        return _dictionaryIds[tableName] = s_to_uint64(_getByKey(ts.cursor, _meta_key("dictionary_id_" + tableName)).second);
+    }
+
+    std::string _pack_row(trans_state& ts, const std::string& tableName, const uint8_t* data, size_t size) const
+    {
+        auto id = _current_dictionary_id(ts, tableName);
+
+        std::string packed(1, (char)1);
+        encode_varint(packed, id);
+        encode_varint(packed, size);
+
+        static const std::string noDictionary;
+        const auto& dictionary = (id != 0) ? _dictionary(ts.txn, tableName, id) : noDictionary;
+
+        packed += lz_compress(data, size, dictionary);
+
+        if(packed.size() >= size + 1)
+        {
+            packed.assign(1, (char)0);
+            packed.append((const char*)data, size);
+        }
+
+        return packed;
+    }
+
+    std::string _unpack_row(MDB_txn* txn, const std::string& tableName, const MDB_val& val) const
+    {
+        auto rh = _row_header(val);
+
+        if(rh.format == 0)
+            return std::string((const char*)rh.body, rh.bodySize);
+
+        static const std::string noDictionary;
+        const auto& dictionary = (rh.dictionaryId != 0) ? _dictionary(txn, tableName, rh.dictionaryId) : noDictionary;
+
+        return lz_decompress(rh.body, rh.bodySize, rh.rawSize, dictionary);
+    }
+
+    std::string _unpack_row(MDB_txn* txn, const std::string& tableName, const std::string& val) const
+    {
+        MDB_val shimVal;
+        shimVal.mv_size = val.size();
+        shimVal.mv_data = const_cast<char*>(val.data());
+        return _unpack_row(txn, tableName, shimVal);
+    }
+
+    // bulk_load() support
+    //
+    // bulk_runs collects one index's entries, spilling them to a temporary file as a sorted run whenever
+    // they pass runBytes. Entries are added in pk order and runs are merged oldest first on ties, so the
+    // pks of equal keys come out in order, as MDB_APPENDDUP requires.
+
+    struct bulk_runs
+    {
+        bulk_runs() = default;
+        bulk_runs(const bulk_runs&) = delete;
+        bulk_runs(bulk_runs&& obj) noexcept : entries(std::move(obj.entries)), bytes(obj.bytes), files(std::move(obj.files)) {}
+
+        ~bulk_runs() noexcept
+        {
+            for(auto f : files)
+                fclose(f);
+        }
+
+        bulk_runs& operator=(const bulk_runs&) = delete;
+
+        void add(const std::string& key, const std::string& data, size_t runBytes)
+        {
+            bytes += key.size() + data.size();
+            entries.push_back(std::make_pair(key, data));
+
+            if(bytes >= runBytes)
+                spill();
+        }
+
+        void sort()
+        {
+            std::stable_sort(entries.begin(), entries.end(), [](const std::pair<std::string, std::string>& a, const std::pair<std::string, std::string>& b){
+                return a.first < b.first;
+            });
+        }
+
+        void spill()
+        {
+            sort();
+
+            auto f = tmpfile();
+            if(!f)
+                throw std::runtime_error(("Unable to create bulk_load() temporary file."));
+            files.push_back(f);
+
+            for(auto& e : entries)
+            {
+                _write_field(f, e.first);
+                _write_field(f, e.second);
+            }
+
+            if(fflush(f) != 0)
+                throw std::runtime_error(("Unable to write bulk_load() temporary file."));
+
+            rewind(f);
+
+            entries.clear();
+            bytes = 0;
+        }
+
+        static void _write_field(FILE* f, const std::string& field)
+        {
+            uint32_t size = (uint32_t)field.size();
+            if(fwrite(&size, sizeof(size), 1, f) != 1 || (size > 0 && fwrite(field.data(), size, 1, f) != 1))
+                throw std::runtime_error(("Unable to write bulk_load() temporary file."));
+        }
+
+        static bool _read_field(FILE* f, std::string& field)
+        {
+            uint32_t size;
+            if(fread(&size, sizeof(size), 1, f) != 1)
+                return false;
+
+            field.resize(size);
+            if(size > 0 && fread(&field[0], size, 1, f) != 1)
+                throw std::runtime_error(("Unable to read bulk_load() temporary file."));
+
+            return true;
+        }
+
+        std::vector<std::pair<std::string, std::string>> entries;
+        size_t bytes {0};
+        std::vector<FILE*> files;
+    };
+
+    // Merges a bulk_runs' spilled runs and its remaining in memory entries into one sorted stream.
+    class bulk_merge
+    {
+    public:
+        bulk_merge(bulk_runs& runs) :
+            _runs(runs),
+            _heads(runs.files.size() + 1),
+            _memPos(0),
+            _queue(_greater(this))
+        {
+            _runs.sort();
+
+            for(size_t r = 0; r < _heads.size(); ++r)
+                _advance(r);
+        }
+
+        bool done() const { return _queue.empty(); }
+        const std::string& key() const { return _heads[_queue.top()].first; }
+        const std::string& data() const { return _heads[_queue.top()].second; }
+
+        void next()
+        {
+            auto r = _queue.top();
+            _queue.pop();
+            _advance(r);
+        }
+
+    private:
+        // The last run is the entries still in memory.
+        void _advance(size_t r)
+        {
+            bool more;
+
+            if(r < _runs.files.size())
+            {
+                more = bulk_runs::_read_field(_runs.files[r], _heads[r].first);
+                if(more && !bulk_runs::_read_field(_runs.files[r], _heads[r].second))
+                    throw std::runtime_error(("Truncated bulk_load() temporary file."));
+            }
+            else
+            {
+                more = _memPos < _runs.entries.size();
+                if(more)
+                    _heads[r] = std::move(_runs.entries[_memPos++]);
+            }
+
+            if(more)
+                _queue.push(r);
+        }
+
+        struct _greater
+        {
+            _greater(const bulk_merge* m) : merge(m) {}
+
+            bool operator()(size_t a, size_t b) const
+            {
+                auto c = merge->_heads[a].first.compare(merge->_heads[b].first);
+                return (c != 0) ? c > 0 : a > b;
+            }
+
+            const bulk_merge* merge;
+        };
+
+        bulk_runs& _runs;
+        std::vector<std::pair<std::string, std::string>> _heads;
+        size_t _memPos;
+        std::priority_queue<size_t, std::vector<size_t>, _greater> _queue;
+    };
+
+    // JSON rows of uncompressed tables are stored exactly as they were inserted.
+    static bool _stored_as_is(const table_info& ti)
+    {
+        return !ti.binary_rows && !ti.compressed;
+    }
+
+    // Returns what's stored for a row: its JSON text or binary encoding, compressed if the table is.
+    std::string _stored_row(trans_state& ts, const std::string& tableName, const table_info& ti, const nlohmann::json& j, const uint8_t* row, size_t size) const
+    {
+        if(ti.binary_rows)
+        {
+            auto data = ti.codec.encode(j);
+            return (ti.compressed) ? _pack_row(ts, tableName, (const uint8_t*)data.data(), data.size()) : data;
+        }
+
+        return (ti.compressed) ? _pack_row(ts, tableName, row, size) : std::string((const char*)row, size);
+    }
+
+    // Index footprints
+    //
+    // Every stored row starts with its footprint: a varint byte count followed by, for each of the
+    // table's indexes (in ti.indexes order), the row's varint length prefixed key in that index and, for
+    // covering indexes, its varint length prefixed include payload. That's all it takes to find the
+    // row's index entries, so removing or updating a row never looks at (or decompresses) the row itself.
+
+    // Returns the index entries for row j (which gets pk).
+    static std::vector<index_entry> _index_entries(const table_info& ti, uint64_t pk, const nlohmann::json& j)
+    {
+        std::vector<index_entry> entries;
+        entries.reserve(ti.indexes.size());
+
+        _visit_index_keys(ti, j, [&](const index_info& ii, const std::string& key){
+            entries.push_back(index_entry{ii.dbi, key, _index_data(ii, pk, j)});
+        });
+
+        return entries;
+    }
+
+    static std::string _footprint(const table_info& ti, const std::vector<index_entry>& entries)
+    {
+        std::string fields;
+
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            encode_varint(fields, entries[i].key.size());
+            fields += entries[i].key;
+
+            if(!ti.indexes[i].include.empty())
+            {
+                encode_varint(fields, entries[i].data.size() - sizeof(uint64_t));
+                fields.append(entries[i].data, sizeof(uint64_t), std::string::npos);
+            }
+        }
+
+        std::string footprint;
+        encode_varint(footprint, fields.size());
+        return footprint + fields;
+    }
+
+    static std::string _footprint_field(const uint8_t*& p, const uint8_t* end)
+    {
+        auto size = decode_varint(p, end);
+        if(size > (uint64_t)(end - p))
+            throw std::runtime_error(("Malformed row footprint."));
+
+        std::string field((const char*)p, size);
+        p += size;
+        return field;
+    }
+
+    // Rebuilds row pk's index entries from the footprint at the front of stored.
+    static std::vector<index_entry> _footprint_entries(const table_info& ti, uint64_t pk, const MDB_val& stored)
+    {
+        auto p = (const uint8_t*)stored.mv_data;
+        auto end = _row_payload(stored).mv_data;
+
+        decode_varint(p, (const uint8_t*)end);
+
+        std::vector<index_entry> entries;
+        entries.reserve(ti.indexes.size());
+
+        for(auto& ii : ti.indexes)
+        {
+            index_entry e {ii.dbi, _footprint_field(p, (const uint8_t*)end), std::string()};
+
+            if(ii.include.empty())
+                e.data = _row_key(pk);
+            else
+            {
+                encode_key_uint64(e.data, pk);
+                e.data += _footprint_field(p, (const uint8_t*)end);
+            }
+
+            entries.push_back(std::move(e));
+        }
+
+        return entries;
+    }
+
+    // Returns what follows a stored row's footprint: its JSON, binary encoding or compressed form.
+    static MDB_val _row_payload(const MDB_val& stored)
+    {
+        auto p = (const uint8_t*)stored.mv_data;
+        auto end = p + stored.mv_size;
+
+        auto size = decode_varint(p, end);
+        if(size > (uint64_t)(end - p))
+            throw std::runtime_error(("Malformed row footprint."));
+
+        MDB_val payload;
+        payload.mv_data = const_cast<uint8_t*>(p + size);
+        payload.mv_size = end - (p + size);
+        return payload;
+    }
+
+    // Returns stored row pk, which is valid until the next write.
+    // Returns the pk a table key holds.
+    static uint64_t _row_pk(const MDB_val& key)
+    {
+        if(key.mv_size != sizeof(uint64_t))
+            throw std::runtime_error(("Malformed primary key."));
+
+        uint64_t pk;
+        memcpy(&pk, key.mv_data, sizeof(pk));
+        return pk;
+    }
+
+    static MDB_val _get_row(trans_state& ts, const table_info& ti, uint64_t pk)
+    {
+        MDB_val key, val;
+        key.mv_size = sizeof(pk);
+        key.mv_data = &pk;
+
+        if(mdb_get(ts.txn, ti.dbi, &key, &val) != 0)
+            throw std::runtime_error(("Unable to locate row."));
+
+        return val;
+    }
+
+    // Appends a row to its table (pks only ever increase so every new row belongs at the end), copying
+    // its footprint and data straight into space reserved in the map.
+    static void _append_row(trans_state& ts, const table_info& ti, uint64_t pk, const std::string& footprint, const uint8_t* data, size_t size)
+    {
+        auto p = _reserveByKey(ts.txn, ti.dbi, _row_key(pk), footprint.size() + size, MDB_APPEND);
+        memcpy(p, footprint.data(), footprint.size());
+        memcpy(p + footprint.size(), data, size);
+    }
+
+    // Inserts a row given the fields its index entries are built from (j).
+    uint64_t _insert(trans_state& ts, const std::string& tableName, const table_info& ti, const nlohmann::json& j, const uint8_t* row, size_t size)
+    {
+        auto newID = _pkCounters[tableName].next_pk;
+
+        // Encode every index entry before writing anything (or taking the pk) so a row with a bad index
+        // value is rejected without leaving part of itself behind.
+        auto indexEntries = _index_entries(ti, newID, j);
+
+        std::string encoded;
+        if(!_stored_as_is(ti))
+        {
+            encoded = _stored_row(ts, tableName, ti, j, row, size);
+            row = (const uint8_t*)encoded.data();
+            size = encoded.size();
+        }
+
+        _allocate_pks(tableName, 1);
+
+        _append_row(ts, ti, newID, _footprint(ti, indexEntries), row, size);
+
+        _pkCounters[tableName].last_insert_id = newID;
+        _txnBytes += size;
+
+        for(auto& ie : indexEntries)
+            _putByKey(ts.txn, ie.dbi, ie.key, ie.data);
+
+        return newID;
+    }
+
+    // Overwrites row pk with a row whose index fields are j, then swaps out just the index entries that
+    // changed.
+    void _update(trans_state& ts, const std::string& tableName, const table_info& ti, uint64_t pk, const nlohmann::json& j, const uint8_t* row, size_t size)
+    {
+        auto oldEntries = _footprint_entries(ti, pk, _get_row(ts, ti, pk));
+
+        // As in _insert(), the new row is fully encoded before anything is written.
+        auto newEntries = _index_entries(ti, pk, j);
+        auto footprint = _footprint(ti, newEntries);
+
+        std::string encoded;
+        if(!_stored_as_is(ti))
+        {
+            encoded = _stored_row(ts, tableName, ti, j, row, size);
+            row = (const uint8_t*)encoded.data();
+            size = encoded.size();
+        }
+
+        auto p = _reserveByKey(ts.txn, ti.dbi, _row_key(pk), footprint.size() + size, 0);
+        memcpy(p, footprint.data(), footprint.size());
+        memcpy(p + footprint.size(), row, size);
+        _txnBytes += size;
+
+        // Entries are always in ti.indexes order, so old and new pair up.
+        for(size_t i = 0; i < newEntries.size(); ++i)
+        {
+            if(oldEntries[i].key == newEntries[i].key && oldEntries[i].data == newEntries[i].data)
+                continue;
+
+            _removeByKey(ts.txn, oldEntries[i].dbi, oldEntries[i].key, oldEntries[i].data);
+            _putByKey(ts.txn, newEntries[i].dbi, newEntries[i].key, newEntries[i].data);
+        }
+    }
+
+    // Removes a row and the index entries its footprint points at.
+    void _remove(trans_state& ts, const table_info& ti, uint64_t pk)
+    {
+        for(auto& e : _footprint_entries(ti, pk, _get_row(ts, ti, pk)))
+            _removeByKey(ts.txn, e.dbi, e.key, e.data);
+
+        _removeByKey(ts.txn, ti.dbi, _row_key(pk));
+    }
+
+    // Removes the rows in ii between loKey (inclusive, or the first entry if empty) and hiKey (exclusive,
+    // or the last entry if empty), stopping at the first index value after maxRows rows.
+    uint64_t _remove_range(trans_state& ts, const table_info& ti, const index_info& ii, const std::string& loKey, const std::string& hiKey, size_t maxRows)
+    {
+        std::vector<uint64_t> pks;
+
+        _with_cursor(ts, ii.dbi, [&](MDB_cursor* cursor){
+            MDB_val key, val;
+            key.mv_size = loKey.size();
+            key.mv_data = const_cast<char*>(loKey.data());
+
+            auto rc = mdb_cursor_get(cursor, &key, &val, (loKey.empty()) ? MDB_FIRST : MDB_SET_RANGE);
+
+            while(rc == 0 && pks.size() < maxRows && (hiKey.empty() || _compare(key, hiKey) < 0))
+            {
+                do
+                {
+                    pks.push_back(_entry_pk(ii, val));
+                    rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT_DUP);
+                }
+                while(rc == 0);
+
+                if(rc != MDB_NOTFOUND)
+                    throw std::runtime_error(("Unable to read duplicates."));
+
+                // Deletes the key and all of its pks, leaving the cursor on the next key.
+                _check_mdb(mdb_cursor_del(cursor, MDB_NODUPDATA), "Unable to mdb_cursor_del().");
+
+                rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+            }
+
+            if(rc != 0 && rc != MDB_NOTFOUND)
+                throw std::runtime_error(("Unable to walk index."));
+        });
+
+        std::sort(pks.begin(), pks.end());
+
+        // Gather every other index's entries for our rows so each index can be swept in key order.
+        std::map<MDB_dbi, std::vector<std::pair<std::string, std::string>>> entries;
+
+        // The rows are read and deleted in one pass over the table. Rows in a range are often next to
+        // each other, so each is looked for with MDB_NEXT before seeking to it.
+        _with_cursor(ts, ti.dbi, [&](MDB_cursor* cursor){
+            bool positioned = false;
+
+            for(auto pk : pks)
+            {
+                MDB_val key, val;
+
+                if(!positioned || mdb_cursor_get(cursor, &key, &val, MDB_NEXT) != 0 || _row_pk(key) != pk)
+                {
+                    key.mv_size = sizeof(pk);
+                    key.mv_data = &pk;
+
+                    if(mdb_cursor_get(cursor, &key, &val, MDB_SET_RANGE) != 0 || _row_pk(key) != pk)
+                        throw std::runtime_error(("Unable to locate row."));
+                }
+
+                for(auto& e : _footprint_entries(ti, pk, val))
+                {
+                    if(e.dbi != ii.dbi)
+                        entries[e.dbi].push_back(std::make_pair(std::move(e.key), std::move(e.data)));
+                }
+
+                _check_mdb(mdb_cursor_del(cursor, 0), "Unable to mdb_cursor_del().");
+                positioned = true;
+            }
+        });
+
+        for(auto& ep : entries)
+        {
+            std::sort(ep.second.begin(), ep.second.end());
+            _delete_sorted(ts, ep.first, ep.second);
+        }
+
+        return pks.size();
+    }
+
+    // Encodes a remove_range() or find_range() bound: a value, or an array of leading values for a
+    // compound index. An open (null) bound encodes to an empty key.
+    static std::string _range_key(const index_info& ii, const nlohmann::json& bound)
+    {
+        if(bound.is_null())
+            return std::string();
+
+        auto vals = (bound.is_array()) ? bound : nlohmann::json::array({bound});
+
+        if(vals.size() > ii.types.size())
+            throw std::runtime_error(("Too many values for index."));
+
+        std::string key;
+        for(size_t i = 0; i < vals.size(); ++i)
+            _encode_value(key, ii.types[i], vals[i]);
+
+        return key;
+    }
+
+    static int _compare(const MDB_val& val, const std::string& key)
+    {
+        auto cmp = memcmp(val.mv_data, key.data(), std::min(val.mv_size, key.size()));
+        if(cmp != 0)
+            return cmp;
+        return (val.mv_size < key.size()) ? -1 : (val.mv_size > key.size()) ? 1 : 0;
+    }
+
+    // Returns the pk an index entry's data points at.
+    static uint64_t _entry_pk(const index_info& ii, const MDB_val& val)
+    {
+        if(ii.include.empty())
+        {
+            if(val.mv_size != sizeof(uint64_t))
+                throw std::runtime_error(("Malformed primary key."));
+
+            uint64_t pk;
+            memcpy(&pk, val.mv_data, sizeof(pk));
+            return pk;
+        }
+
+        if(val.mv_size < sizeof(uint64_t))
+            throw std::runtime_error(("Malformed covering index entry."));
+
+        auto p = (const uint8_t*)val.mv_data;
+        return decode_key_uint64(p, p + val.mv_size);
+    }
+
+    // Deletes sorted (key, data) entries from an index with one cursor.
+    static void _delete_sorted(trans_state& ts, MDB_dbi dbi, const std::vector<std::pair<std::string, std::string>>& entries)
+    {
+        _with_cursor(ts, dbi, [&](MDB_cursor* cursor){
+            for(auto& e : entries)
+            {
+                MDB_val key, val;
+                key.mv_size = e.first.size();
+                key.mv_data = const_cast<char*>(e.first.data());
+                val.mv_size = e.second.size();
+                val.mv_data = const_cast<char*>(e.second.data());
+
+                _check_mdb(mdb_cursor_get(cursor, &key, &val, MDB_GET_BOTH), "Unable to locate index entry.");
+                _check_mdb(mdb_cursor_del(cursor, 0), "Unable to mdb_cursor_del().");
+            }
+        });
+    }
+
+    template<typename CURSORCB>
+    static void _with_cursor(trans_state& ts, MDB_dbi dbi, CURSORCB ccb)
+    {
+        MDB_cursor* cursor;
+        if(mdb_cursor_open(ts.txn, dbi, &cursor) != 0)
+            throw std::runtime_error(("Unable to open cursor."));
+
+        try
+        {
+            ccb(cursor);
+        }
+        catch(...)
+        {
+            mdb_cursor_close(cursor);
+            throw;
+        }
+
+        mdb_cursor_close(cursor);
+    }
+
+    // Asks ecb for each of the fields a row's index entries are built from.
+    template<typename EXTCB>
+    static nlohmann::json _extract_fields(const table_info& ti, const uint8_t* src, size_t size, EXTCB ecb)
+    {
+        auto j = nlohmann::json::object();
+
+        for(auto& col : ti.extractor.fields())
+        {
+            nlohmann::json val = ecb(col, src, size);
+            if(!val.is_null())
+                j[col] = val;
+        }
+
+        return j;
+    }
+
+    // Parses an incoming row. Binary rows need the whole row, otherwise only the fields our index entries
+    // are built from are extracted.
+    static nlohmann::json _parse_row(const table_info& ti, const uint8_t* row, size_t size)
+    {
+        return (ti.binary_rows) ? nlohmann::json::parse(row, row + size) : ti.extractor.extract(row, size);
+    }
+
+    // Calls kcb once with each index (regular and compound) and the encoded key of row j's entry in it.
+    template<typename KEYCB>
+    static void _visit_index_keys(const table_info& ti, const nlohmann::json& j, KEYCB kcb)
+    {
+        for(auto& ii : ti.indexes)
+        {
+            std::string key;
+            for(size_t i = 0; i < ii.columns.size(); ++i)
+            {
+                auto found = j.find(ii.columns[i]);
+                if(found == j.end())
+                    throw std::runtime_error(("Row is missing index column: " + ii.columns[i]));
+
+                _encode_value(key, ii.types[i], *found);
+            }
+            kcb(ii, key);
+        }
+    }
+
+    // Group commit
+
+    struct queued_write
+    {
+        std::function<void(trans_state&)> tcb;
+        std::promise<void> done;
+    };
+
+    void _commit_loop()
+    {
+        std::unique_lock<std::mutex> g(_commitLok);
+
+        while(true)
+        {
+            _commitCond.wait(g, [this](){ return !_commitQueue.empty() || !_committerRunning; });
+
+            if(_commitQueue.empty())
+                return;
+
+            _commitCond.wait_until(g, std::chrono::steady_clock::now() + _maxLinger, [this](){
+                return _commitQueue.size() >= _maxBatch || !_committerRunning;
+            });
+
+            std::vector<queued_write> batch;
+            while(!_commitQueue.empty() && batch.size() < _maxBatch)
+            {
+                batch.push_back(std::move(_commitQueue.front()));
+                _commitQueue.pop_front();
+            }
+
+            g.unlock();
+            _commit_batch(batch);
+            g.lock();
+        }
+    }
+
+    void _commit_batch(std::vector<queued_write>& batch)
+    {
+        std::vector<std::exception_ptr> errors(batch.size());
+
+        try
+        {
+            transaction([&](trans_state& ts){
+                for(size_t i = 0; i < batch.size(); ++i)
+                {
+                    if(!_savepoints)
+                    {
+                        batch[i].tcb(ts);
+                        continue;
+                    }
+
+                    errors[i] = nullptr;
+
+                    try
+                    {
+                        savepoint(ts, batch[i].tcb);
+                    }
+                    catch(map_size_error&)
+                    {
+                        throw;
+                    }
+                    catch(...)
+                    {
+                        errors[i] = std::current_exception();
+                    }
+                }
+            });
+
+            for(size_t i = 0; i < batch.size(); ++i)
+            {
+                if(errors[i])
+                    batch[i].done.set_exception(errors[i]);
+                else batch[i].done.set_value();
+            }
+
+            return;
+        }
+        catch(...)
+        {
+            if(batch.size() == 1)
+            {
+                batch.front().done.set_exception(std::current_exception());
+                return;
+            }
+        }
+
+        for(auto& qw : batch)
+        {
+            try
+            {
+                transaction(qw.tcb);
+                qw.done.set_value();
+            }
+            catch(...)
+            {
+                qw.done.set_exception(std::current_exception());
+            }
+        }
+    }
+
+    // Map resizing
+    //
+    // mdb_env_set_mapsize() may only be called while nothing in this process is using the map, so our
+    // read transactions (iterators, mostly) are counted and a resize waits for them to finish (and holds
+    // off new ones). Write transactions are kept out by _transLok. A resize gives up if readers are still
+    // open after TABLES_RESIZE_WAIT_MS, since the thread resizing might be the one holding them.
+
+    MDB_txn* _begin_read() const
+    {
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> g(_readersLok);
+                _readersCond.wait(g, [this](){ return !_resizing; });
+                ++_readers;
+            }
+
+            MDB_txn* txn;
+            auto rc = mdb_txn_begin(_env, NULL, MDB_RDONLY, &txn);
+            if(rc == 0)
+                return txn;
+
+            _reader_done();
+
+            // Another process grew the map, so adopt its new size and try again.
+            if(rc != MDB_MAP_RESIZED || !_set_map_size(0))
+                throw std::runtime_error(("Unable to create transaction."));
+        }
+    }
+
+    void _end_read(MDB_txn* txn) const
+    {
+        mdb_txn_abort(txn);
+        _reader_done();
+    }
+
+    void _reader_done() const
+    {
+        std::unique_lock<std::mutex> g(_readersLok);
+        if(--_readers == 0)
+            _readersCond.notify_all();
+    }
+
+    // Sets the map size (0 adopts a size set by another process).
+    bool _set_map_size(size_t size) const
+    {
+        std::unique_lock<std::recursive_mutex> t(_transLok);
+        std::unique_lock<std::mutex> g(_readersLok);
+
+        _resizing = true;
+
+        auto ok = _readersCond.wait_for(g, std::chrono::milliseconds(TABLES_RESIZE_WAIT_MS), [this](){ return _readers == 0; }) &&
+                  mdb_env_set_mapsize(_env, size) == 0;
+
+        _resizing = false;
+        _readersCond.notify_all();
+
+        return ok;
+    }
+
+    // Makes room after a map_size_error, returning false if there's none to be had.
+    bool _grow_map()
+    {
+        auto size = map_size();
+
+        // Another process may have already grown it.
+        if(!_set_map_size(0))
+            return false;
+
+        if(map_size() > size)
+            return true;
+
+        if(_mapMaxSize != 0 && size >= _mapMaxSize)
+            return false;
+
+        auto newSize = size + std::min((uint64_t)(size * (_mapGrowth - 1.0)), _mapMaxStep);
+        if(_mapMaxSize != 0)
+            newSize = std::min(newSize, _mapMaxSize);
+
+        return newSize > size && _set_map_size(newSize);
+    }
+
+    // Expiry
+
+    // Like expire(), but gives up between batches once *stopping is set (if stopping isn't NULL).
+    uint64_t _expire(const std::string& tableName, size_t batchRows, const std::atomic<bool>* stopping)
+    {
+        const auto& ti = _table(tableName);
+
+        if(ti.ttl_index < 0)
+            throw std::runtime_error(("Table has no ttl: " + tableName));
+
+        const auto& ii = ti.indexes[ti.ttl_index];
+
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        std::string cutoff;
+        _encode_value(cutoff, column_type::TIMESTAMP, (int64_t)now - ti.ttl_ms);
+
+        batchRows = std::max(batchRows, (size_t)1);
+
+        uint64_t total = 0, removed = 0;
+        do
+        {
+            transaction([&](trans_state& ts){
+                removed = _remove_range(ts, ti, ii, std::string(), cutoff, batchRows);
+            });
+
+            total += removed;
+        }
+        while(removed >= batchRows && !(stopping && *stopping));
+
+        return total;
+    }
+
+    void _expiry_loop()
+    {
+        std::unique_lock<std::mutex> g(_expiryLok);
+
+        while(!_expiryStopping)
+        {
+            _expiryCond.wait_for(g, _expiryInterval, [this](){ return (bool)_expiryStopping; });
+
+            if(_expiryStopping)
+                break;
+
+            g.unlock();
+
+            for(auto& t : _schema)
+            {
+                if(t.second.ttl_index < 0 || _expiryStopping)
+                    continue;
+
+                try
+                {
+                    _expire(t.first, _expiryBatchRows, &_expiryStopping);
+                }
+                catch(...)
+                {
+                    // Nothing to report to, and the next pass will try again.
+                }
+            }
+
+            g.lock();
+        }
+    }
+
+    // Durability
+
+    static unsigned int _durability_flags(durability mode)
+    {
+        switch(mode)
+        {
+            case durability::full: return 0;
+            case durability::no_meta_sync: return MDB_NOMETASYNC;
+            case durability::periodic_sync: return MDB_NOSYNC;
+            case durability::map_async: return MDB_MAPASYNC;
+        }
+
+        throw std::runtime_error(("Unknown durability mode."));
+    }
+
+    // Called after each successful transaction() with the row bytes it wrote. Only modes whose commits
+    // don't reach the disk (see _skipsSyncs) leave anything unsynced.
+    void _committed(uint64_t bytes)
+    {
+        if(!_skipsSyncs)
+            return;
+
+        std::unique_lock<std::mutex> g(_syncLok);
+
+        _unsynced = true;
+        _syncMetrics.unsynced_bytes += bytes;
+
+        if(_syncerRunning && _syncMetrics.unsynced_bytes >= _syncBytes)
+            _syncCond.notify_one();
+    }
+
+    void _sync_loop()
+    {
+        std::unique_lock<std::mutex> g(_syncLok);
+
+        while(_syncerRunning)
+        {
+            _syncCond.wait_for(g, _syncInterval, [this](){
+                return !_syncerRunning || _syncMetrics.unsynced_bytes >= _syncBytes;
+            });
+
+            if(!_unsynced)
+                continue;
+
+            g.unlock();
+
+            try
+            {
+                sync();
+            }
+            catch(...)
+            {
+                // Counted in failed_syncs, and the next pass will try again.
+            }
+
+            g.lock();
+        }
+    }
+
+    void _stop_syncer()
+    {
+        {
+            std::unique_lock<std::mutex> g(_syncLok);
+            _syncerRunning = false;
+        }
+
+        _syncCond.notify_all();
+
+        if(!_syncer.joinable())
+            return;
+
+        _syncer.join();
+
+        // Sync anything committed while the thread was on its way out.
+        if(_unsynced)
+        {
+            try
+            {
+                sync();
+            }
+            catch(...)
+            {
+            }
+        }
+    }
+
     MDB_env* _env;
     uint64_t _version;
     std::map<std::string, table_info> _schema;
     bool _transacting;
-    std::recursive_mutex _transLok;
+    mutable std::recursive_mutex _transLok;
+    std::map<std::string, pk_counters> _pkCounters;
+    size_t _lastWriteTxnID;
+    mutable std::map<std::string, std::string> _dictionaries;
+    mutable std::mutex _dictionaryLok;
+    // Only touched by write transactions, so _transLok covers them.
+    mutable std::map<std::string, uint64_t> _dictionaryIds;
+    std::map<std::string, uint64_t> _pendingDictionaryIds;
+    std::thread _committer;
+    std::mutex _commitLok;
+    std::condition_variable _commitCond;
+    std::deque<queued_write> _commitQueue;
+    bool _committerRunning;
+    size_t _maxBatch;
+    std::chrono::microseconds _maxLinger;
+    uint64_t _txnBytes;
+    std::thread _syncer;
+    mutable std::mutex _syncLok;
+    std::condition_variable _syncCond;
+    bool _syncerRunning;
+    std::chrono::milliseconds _syncInterval;
+    uint64_t _syncBytes;
+    bool _unsynced;
+    bool _skipsSyncs;
+    std::chrono::steady_clock::time_point _lastSync;
+    sync_metrics _syncMetrics;
+    double _mapGrowth;
+    uint64_t _mapMaxStep;
+    uint64_t _mapMaxSize;
+    mutable std::mutex _readersLok;
+    mutable std::condition_variable _readersCond;
+    mutable size_t _readers;
+    mutable bool _resizing;
+    std::thread _expirer;
+    std::mutex _expiryLok;
+    std::condition_variable _expiryCond;
+    std::atomic<bool> _expiryStopping;
+    std::chrono::milliseconds _expiryInterval;
+    size_t _expiryBatchRows;
+    bool _savepoints;
+    bool _savepointMapFull;
 };
 
 }
@@ -0,0 +1,38 @@
+#ifndef __tables_json_extractor_h
+#define __tables_json_extractor_h
+
+#include "tables/json.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tables
+{
+
+// Pulls a few top level fields out of a JSON object in one pass over its text, without building a
+// DOM of the rest of it. Everything else is skipped by scanning (16 bytes at a time with SSE2) for the
+// quotes and brackets that delimit it.
+//
+// Skipped values are only checked for their delimiters, so some malformed JSON in them goes unnoticed.
+// If a field appears more than once the last one wins, as it does with nlohmann::json::parse(), so
+// every insert path indexes the same value. That means the whole object is always scanned.
+class json_extractor final
+{
+public:
+    json_extractor() = default;
+    json_extractor(const std::vector<std::string>& fields);
+
+    const std::vector<std::string>& fields() const { return _fields; }
+
+    // Returns an object holding whichever of our fields the object in p has.
+    nlohmann::json extract(const uint8_t* p, size_t size) const;
+
+private:
+    int _field_index(const uint8_t* name, size_t size) const;
+
+    std::vector<std::string> _fields;
+};
+
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __tables_row_codec_h
+#define __tables_row_codec_h
+
+#include "tables/json.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace tables
+{
+
+// Binary row format for tables whose schema says "row_format": "binary".
+//
+// Column names are interned by the schema (a column's id is its position in columns()) so rows never
+// store them. An encoded row is:
+//
+//     uint16_t count                  number of column ids the row was written with
+//     uint32_t offsets[count + 1]     start of each column's value, then the start of the overflow
+//     values...                       each value msgpack'd, an empty value means the column is absent
+//     overflow                        msgpack'd object of any fields the schema doesn't name (or empty)
+//
+// Integers are native endian. Column i's value runs from offsets[i] to offsets[i + 1], so any one field
+// can be decoded straight out of the mmap'd row without looking at the others.
+class row_codec final
+{
+public:
+    row_codec() = default;
+    row_codec(const std::vector<std::string>& columns);
+
+    const std::vector<std::string>& columns() const { return _columns; }
+
+    std::string encode(const nlohmann::json& row) const;
+
+    // Returns the whole row as a JSON object.
+    nlohmann::json decode(const uint8_t* p, size_t size) const;
+
+    // Decodes one field into val, returning false if the row doesn't have it.
+    bool field(const uint8_t* p, size_t size, const std::string& name, nlohmann::json& val) const;
+
+private:
+    static void _read_header(const uint8_t* p, size_t size, uint16_t& count, const uint8_t*& offsets);
+    static uint32_t _offset(const uint8_t* offsets, size_t i);
+
+    std::vector<std::string> _columns;
+    std::map<std::string, uint16_t> _ids;
+};
+
+}
+
+#endif
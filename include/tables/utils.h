@@ -2,6 +2,7 @@
 #define __tables_utils_h
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <stdexcept>
@@ -18,6 +19,41 @@ std::vector<std::string> split(const std::string& str, const std::string& delim)
 uint64_t s_to_uint64(const std::string& s);
 std::string uint64_to_s(uint64_t val);
 
+// Encoding helpers. Varints are LEB128 (prefix free, used for the lengths in a row's index footprint
+// and for compressed row headers, see json_database.h). Key strings are order preserving: embedded
+// 0x00 bytes are escaped as 0x00 0xFF and the string is terminated by 0x00 0x01. A terminator sorts
+// below any escaped 0x00, so memcmp() order of encoded keys matches the order of the original values,
+// and since it can't occur inside an encoded string no encoded component is a prefix of another.
+void encode_varint(std::string& buffer, uint64_t val);
+uint64_t decode_varint(const uint8_t*& p, const uint8_t* end);
+void encode_key_string(std::string& buffer, const std::string& val);
+std::string decode_key_string(const uint8_t*& p, const uint8_t* end);
+
+// Fixed width order preserving key encodings. All are big endian, signed values have their sign bit
+// flipped and negative doubles have all of their bits flipped.
+void encode_key_uint64(std::string& buffer, uint64_t val);
+uint64_t decode_key_uint64(const uint8_t*& p, const uint8_t* end);
+void encode_key_int64(std::string& buffer, int64_t val);
+void encode_key_double(std::string& buffer, double val);
+
+// Parses "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" (dashes optional) into 16 raw bytes.
+void encode_key_uuid(std::string& buffer, const std::string& uuid);
+
+// Parses a string of hex digits into raw bytes, then encodes them like encode_key_string().
+void encode_key_hex_bytes(std::string& buffer, const std::string& hex);
+
+// Thrown when a write fills the map (MDB_MAP_FULL) or a transaction can't start because another
+// process grew it (MDB_MAP_RESIZED). Either way the map has to be resized before trying again.
+class map_size_error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Throws map_size_error for MDB_MAP_FULL and MDB_MAP_RESIZED, a std::runtime_error with msg for anything
+// else that isn't success.
+void _check_mdb(int rc, const std::string& msg);
+
 struct trans_state
 {
     MDB_txn* txn {NULL};
@@ -26,8 +62,12 @@ struct trans_state
 };
 
 std::pair<std::string, std::string> _getByKey(MDB_cursor* cursor, const std::string& key);
-void _putByKey(MDB_txn* txn, MDB_dbi& dbi, const std::string& key, const std::string& val);
-void _removeByKey(MDB_txn* txn, MDB_dbi& dbi, const std::string& key);
+std::pair<std::string, std::string> _getByKey(MDB_txn* txn, MDB_dbi dbi, const std::string& key);
+void _putByKey(MDB_txn* txn, MDB_dbi dbi, const std::string& key, const std::string& val, unsigned int flags = 0);
+// Makes room for a size byte value (MDB_RESERVE) and returns where to write it. Not for MDB_DUPSORT dbs.
+uint8_t* _reserveByKey(MDB_txn* txn, MDB_dbi dbi, const std::string& key, size_t size, unsigned int flags = 0);
+void _removeByKey(MDB_txn* txn, MDB_dbi dbi, const std::string& key);
+void _removeByKey(MDB_txn* txn, MDB_dbi dbi, const std::string& key, const std::string& val);
 
 void clear_keys();
 void dump_keys();
@@ -47,14 +87,15 @@ void _scanByKeyPrefix(const std::string& keyPrefix, MDB_cursor* cursor, rangeCB
 
     do
     {
-        // two ways out of this loop: 1) finding a value that doesn't start with "table_name_"
+        // two ways out of this loop: 1) finding a key that doesn't start with our encoded prefix
         // 2) hitting the end of data in the db.
+        if(shimKey.mv_size < keyPrefix.length() || memcmp(shimKey.mv_data, keyPrefix.c_str(), keyPrefix.length()) != 0)
+            break;
+
         std::string key((char*)shimKey.mv_data, shimKey.mv_size);
         std::string val((char*)shimVal.mv_data, shimVal.mv_size);
 
-        if(key.compare(0, keyPrefix.length(), keyPrefix) == 0)
-            rcb(keyPrefix, key, val);
-        else break;
+        rcb(keyPrefix, key, val);
 
         if(mdb_cursor_get(cursor, &shimKey, &shimVal, MDB_NEXT) == MDB_NOTFOUND)
             endOfData = true;
@@ -68,8 +109,7 @@ void _transaction(MDB_env* env, bool readOnly, bodyCB f)
 
     try
     {
-        if(mdb_txn_begin(env, NULL, (readOnly)?MDB_RDONLY:0, &ts.txn) != 0)
-            throw std::runtime_error(("Unable to create transaction."));
+        _check_mdb(mdb_txn_begin(env, NULL, (readOnly)?MDB_RDONLY:0, &ts.txn), "Unable to create transaction.");
 
         if(mdb_dbi_open(ts.txn, NULL, 0, &ts.dbi) != 0)
             throw std::runtime_error(("Unable to open/create json_database."));
@@ -80,8 +120,12 @@ void _transaction(MDB_env* env, bool readOnly, bodyCB f)
         f(ts);
 
         mdb_cursor_close(ts.cursor);
+        ts.cursor = NULL;
 
-        mdb_txn_commit(ts.txn);
+        // The txn is gone whether or not the commit worked.
+        auto txn = ts.txn;
+        ts.txn = NULL;
+        _check_mdb(mdb_txn_commit(txn), "Unable to commit transaction.");
     }
     catch (...)
     {
@@ -0,0 +1,292 @@
+
+#include "tables/compression.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace tables;
+using namespace std;
+
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+
+static_assert(LZ_MAX_DICTIONARY_SIZE <= MAX_OFFSET, "Dictionaries must be within a match's reach.");
+
+static uint32_t _hash(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void _put_length(string& out, size_t len)
+{
+    while(len >= 255)
+    {
+        out.push_back((char)255);
+        len -= 255;
+    }
+
+    out.push_back((char)len);
+}
+
+static size_t _get_length(const uint8_t*& p, const uint8_t* end)
+{
+    size_t len = 0;
+
+    while(true)
+    {
+        if(p >= end)
+            throw runtime_error("Truncated lz length.");
+
+        uint8_t b = *p++;
+        len += b;
+
+        if(b != 255)
+            return len;
+    }
+}
+
+static void _put_sequence(string& out, const uint8_t* lit, size_t litLen, size_t offset, size_t matchLen)
+{
+    auto ml = (matchLen > 0) ? matchLen - MIN_MATCH : 0;
+
+    out.push_back((char)((min(litLen, (size_t)15) << 4) | min(ml, (size_t)15)));
+
+    if(litLen >= 15)
+        _put_length(out, litLen - 15);
+
+    out.append((const char*)lit, litLen);
+
+    if(matchLen > 0)
+    {
+        out.push_back((char)(offset & 0xff));
+        out.push_back((char)(offset >> 8));
+
+        if(ml >= 15)
+            _put_length(out, ml - 15);
+    }
+}
+
+string tables::lz_compress(const uint8_t* src, size_t size, const string& dictionary)
+{
+    auto dictSize = min(dictionary.size(), LZ_MAX_DICTIONARY_SIZE);
+
+    // Matches are found in a window of the dictionary followed by the input.
+    string window = dictionary.substr(dictionary.size() - dictSize);
+    window.append((const char*)src, size);
+
+    auto p = (const uint8_t*)window.data();
+    size_t end = window.size();
+
+    vector<int32_t> table(1 << HASH_BITS, -1);
+
+    for(size_t i = 0; i + MIN_MATCH <= dictSize; ++i)
+        table[_hash(p + i)] = (int32_t)i;
+
+    string out;
+    out.reserve((size / 2) + 16);
+
+    size_t anchor = dictSize, i = dictSize;
+
+    while(i + MIN_MATCH <= end)
+    {
+        auto h = _hash(p + i);
+        auto cand = table[h];
+        table[h] = (int32_t)i;
+
+        if(cand >= 0 && (i - cand) <= MAX_OFFSET && memcmp(p + cand, p + i, MIN_MATCH) == 0)
+        {
+            size_t len = MIN_MATCH;
+            while(i + len < end && p[cand + len] == p[i + len])
+                ++len;
+
+            _put_sequence(out, p + anchor, i - anchor, i - cand, len);
+
+            for(size_t j = i + 1; j < i + len && j + MIN_MATCH <= end; ++j)
+                table[_hash(p + j)] = (int32_t)j;
+
+            i += len;
+            anchor = i;
+        }
+        else ++i;
+    }
+
+    _put_sequence(out, p + anchor, end - anchor, 0, 0);
+
+    return out;
+}
+
+string tables::lz_decompress(const uint8_t* src, size_t size, size_t rawSize, const string& dictionary)
+{
+    auto dictSize = min(dictionary.size(), LZ_MAX_DICTIONARY_SIZE);
+
+    string out = dictionary.substr(dictionary.size() - dictSize);
+    out.reserve(dictSize + rawSize);
+
+    const uint8_t* p = src;
+    const uint8_t* end = src + size;
+
+    while(true)
+    {
+        if(p >= end)
+            throw runtime_error("Truncated lz stream.");
+
+        uint8_t token = *p++;
+
+        size_t litLen = token >> 4;
+        if(litLen == 15)
+            litLen += _get_length(p, end);
+
+        if((size_t)(end - p) < litLen || (out.size() - dictSize) + litLen > rawSize)
+            throw runtime_error("Malformed lz literals.");
+
+        out.append((const char*)p, litLen);
+        p += litLen;
+
+        if(p == end)
+            break;
+
+        if(end - p < 2)
+            throw runtime_error("Truncated lz offset.");
+
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+
+        size_t matchLen = token & 0x0f;
+        if(matchLen == 15)
+            matchLen += _get_length(p, end);
+        matchLen += MIN_MATCH;
+
+        if(offset == 0 || offset > out.size() || (out.size() - dictSize) + matchLen > rawSize)
+            throw runtime_error("Malformed lz match.");
+
+        // Matches may overlap the bytes they produce, so they're copied a byte at a time.
+        size_t from = out.size() - offset;
+        for(size_t i = 0; i < matchLen; ++i)
+        {
+            char c = out[from + i];
+            out.push_back(c);
+        }
+    }
+
+    if(out.size() - dictSize != rawSize)
+        throw runtime_error("lz stream has the wrong size.");
+
+    out.erase(0, dictSize);
+
+    return out;
+}
+
+static uint64_t _fnv1a(const uint8_t* p, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+string tables::lz_train_dictionary(const vector<string>& samples, size_t maxSize)
+{
+    maxSize = min(maxSize, LZ_MAX_DICTIONARY_SIZE);
+
+    const size_t segmentSize = 16;
+
+    struct segment
+    {
+        size_t lastSample;
+        size_t samples;
+        size_t sample;
+        size_t pos;
+    };
+
+    // Count how many samples contain each segment, remembering where we first saw it.
+    unordered_map<uint64_t, segment> segments;
+    for(size_t s = 0; s < samples.size(); ++s)
+    {
+        auto p = (const uint8_t*)samples[s].data();
+
+        for(size_t i = 0; i + segmentSize <= samples[s].size(); ++i)
+        {
+            auto h = _fnv1a(p + i, segmentSize);
+
+            auto found = segments.find(h);
+            if(found == segments.end())
+                segments[h] = segment{s, 1, s, i};
+            else if(found->second.lastSample != s)
+            {
+                found->second.lastSample = s;
+                ++found->second.samples;
+            }
+        }
+    }
+
+    vector<const segment*> candidates;
+    for(auto& sp : segments)
+    {
+        if(sp.second.samples > 1)
+            candidates.push_back(&sp.second);
+    }
+
+    sort(candidates.begin(), candidates.end(), [](const segment* a, const segment* b){
+        if(a->samples != b->samples)
+            return a->samples > b->samples;
+        return (a->sample != b->sample) ? a->sample < b->sample : a->pos < b->pos;
+    });
+
+    // Take the most shared segments first, growing each one along its sample for as long as the
+    // segments it runs into are shared about as widely, so repeated runs become a single piece.
+    unordered_set<uint64_t> covered;
+    vector<string> pieces;
+    size_t total = 0;
+
+    auto shared = [&](const uint8_t* p, size_t minSamples) {
+        auto h = _fnv1a(p, segmentSize);
+        if(covered.count(h))
+            return false;
+        auto found = segments.find(h);
+        return found != segments.end() && found->second.samples >= minSamples;
+    };
+
+    for(auto c : candidates)
+    {
+        if(total + segmentSize > maxSize)
+            break;
+
+        auto& sample = samples[c->sample];
+        auto p = (const uint8_t*)sample.data();
+
+        if(covered.count(_fnv1a(p + c->pos, segmentSize)))
+            continue;
+
+        auto minSamples = max((size_t)2, c->samples / 2);
+
+        size_t begin = c->pos, end = c->pos + segmentSize;
+
+        while(begin > 0 && total + (end - begin) < maxSize && shared(p + begin - 1, minSamples))
+            --begin;
+
+        while(end < sample.size() && total + (end - begin) < maxSize && shared(p + end + 1 - segmentSize, minSamples))
+            ++end;
+
+        for(size_t i = begin; i + segmentSize <= end; ++i)
+            covered.insert(_fnv1a(p + i, segmentSize));
+
+        pieces.emplace_back((const char*)p + begin, end - begin);
+        total += end - begin;
+    }
+
+    // The most shared segments go last, closest to the data.
+    string dictionary;
+    dictionary.reserve(total);
+    for(auto it = pieces.rbegin(); it != pieces.rend(); ++it)
+        dictionary += *it;
+
+    return dictionary;
+}
@@ -0,0 +1,209 @@
+
+#include "tables/json_extractor.h"
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace tables;
+using namespace std;
+
+static bool _is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const uint8_t* _skip_space(const uint8_t* p, const uint8_t* end)
+{
+    while(p < end && _is_space(*p))
+        ++p;
+    return p;
+}
+
+// Returns the first '"' or '\\' at or after p (or end).
+static const uint8_t* _find_string_special(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    while(end - p >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)));
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+
+    while(p < end && *p != '"' && *p != '\\')
+        ++p;
+
+    return p;
+}
+
+// Returns the first '"', '{', '}', '[' or ']' at or after p (or end).
+static const uint8_t* _find_structural(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i openBrace = _mm_set1_epi8('{');
+    const __m128i closeBrace = _mm_set1_epi8('}');
+    const __m128i openBracket = _mm_set1_epi8('[');
+    const __m128i closeBracket = _mm_set1_epi8(']');
+
+    while(end - p >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, quote),
+                       _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, openBrace), _mm_cmpeq_epi8(block, closeBrace)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(block, openBracket), _mm_cmpeq_epi8(block, closeBracket))));
+
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+
+    while(p < end && *p != '"' && *p != '{' && *p != '}' && *p != '[' && *p != ']')
+        ++p;
+
+    return p;
+}
+
+// p is just past an opening quote, returns just past the closing one.
+static const uint8_t* _skip_string(const uint8_t* p, const uint8_t* end)
+{
+    while(true)
+    {
+        p = _find_string_special(p, end);
+
+        if(p >= end)
+            throw runtime_error("Unterminated string in JSON row.");
+
+        if(*p == '"')
+            return p + 1;
+
+        p += 2;
+    }
+}
+
+static const uint8_t* _skip_value(const uint8_t* p, const uint8_t* end)
+{
+    if(p >= end)
+        throw runtime_error("Truncated JSON row.");
+
+    if(*p == '"')
+        return _skip_string(p + 1, end);
+
+    if(*p == '{' || *p == '[')
+    {
+        size_t depth = 1;
+        ++p;
+
+        while(depth > 0)
+        {
+            p = _find_structural(p, end);
+
+            if(p >= end)
+                throw runtime_error("Unterminated object or array in JSON row.");
+
+            auto c = *p++;
+
+            if(c == '"')
+                p = _skip_string(p, end);
+            else if(c == '{' || c == '[')
+                ++depth;
+            else --depth;
+        }
+
+        return p;
+    }
+
+    // Numbers, true, false and null.
+    auto start = p;
+    while(p < end && *p != ',' && *p != '}' && *p != ']' && !_is_space(*p))
+        ++p;
+
+    if(p == start)
+        throw runtime_error("Expected a value in JSON row.");
+
+    return p;
+}
+
+json_extractor::json_extractor(const vector<string>& fields) :
+    _fields(fields)
+{
+}
+
+nlohmann::json json_extractor::extract(const uint8_t* p, size_t size) const
+{
+    auto end = p + size;
+
+    auto result = nlohmann::json::object();
+
+    p = _skip_space(p, end);
+    if(p >= end || *p != '{')
+        throw runtime_error("JSON row is not an object.");
+
+    p = _skip_space(p + 1, end);
+    if(p < end && *p == '}')
+        return result;
+
+    while(true)
+    {
+        if(p >= end || *p != '"')
+            throw runtime_error("Expected a field name in JSON row.");
+
+        auto nameBegin = p + 1;
+        auto nameEnd = _skip_string(nameBegin, end);
+
+        int idx;
+        if(memchr(nameBegin, '\\', (nameEnd - 1) - nameBegin) == NULL)
+            idx = _field_index(nameBegin, (nameEnd - 1) - nameBegin);
+        else
+        {
+            // Escaped names are rare enough to just let the real parser unescape them.
+            auto name = nlohmann::json::parse(nameBegin - 1, nameEnd).get<string>();
+            idx = _field_index((const uint8_t*)name.data(), name.size());
+        }
+
+        p = _skip_space(nameEnd, end);
+        if(p >= end || *p != ':')
+            throw runtime_error("Expected ':' in JSON row.");
+
+        p = _skip_space(p + 1, end);
+
+        auto valueEnd = _skip_value(p, end);
+
+        // A repeated field replaces its earlier value, just like nlohmann::json::parse() does.
+        if(idx >= 0)
+            result[_fields[idx]] = nlohmann::json::parse(p, valueEnd);
+
+        p = _skip_space(valueEnd, end);
+
+        if(p < end && *p == ',')
+            p = _skip_space(p + 1, end);
+        else if(p < end && *p == '}')
+            break;
+        else throw runtime_error("Expected ',' or '}' in JSON row.");
+    }
+
+    return result;
+}
+
+int json_extractor::_field_index(const uint8_t* name, size_t size) const
+{
+    for(size_t i = 0; i < _fields.size(); ++i)
+    {
+        if(_fields[i].size() == size && memcmp(_fields[i].data(), name, size) == 0)
+            return (int)i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,148 @@
+
+#include "tables/row_codec.h"
+#include <cstring>
+#include <stdexcept>
+
+using namespace tables;
+using namespace std;
+
+row_codec::row_codec(const vector<string>& columns) :
+    _columns(columns),
+    _ids()
+{
+    if(_columns.size() > 0xffff)
+        throw runtime_error("Too many columns for binary rows.");
+
+    for(size_t i = 0; i < _columns.size(); ++i)
+        _ids[_columns[i]] = (uint16_t)i;
+}
+
+string row_codec::encode(const nlohmann::json& row) const
+{
+    if(!row.is_object())
+        throw runtime_error("Binary rows must be JSON objects.");
+
+    uint16_t count = (uint16_t)_columns.size();
+    size_t headerSize = sizeof(count) + ((count + 1) * sizeof(uint32_t));
+
+    string buffer(headerSize, '\0');
+    memcpy(&buffer[0], &count, sizeof(count));
+
+    vector<uint32_t> offsets(count + 1);
+
+    for(uint16_t i = 0; i < count; ++i)
+    {
+        offsets[i] = (uint32_t)buffer.length();
+
+        auto found = row.find(_columns[i]);
+        if(found != row.end())
+            nlohmann::json::to_msgpack(*found, buffer);
+    }
+
+    offsets[count] = (uint32_t)buffer.length();
+
+    auto overflow = nlohmann::json::object();
+    for(auto it = row.begin(); it != row.end(); ++it)
+    {
+        if(_ids.find(it.key()) == _ids.end())
+            overflow[it.key()] = it.value();
+    }
+
+    if(!overflow.empty())
+        nlohmann::json::to_msgpack(overflow, buffer);
+
+    if(buffer.length() > 0xffffffff)
+        throw runtime_error("Row too large for binary rows.");
+
+    memcpy(&buffer[sizeof(count)], &offsets[0], offsets.size() * sizeof(uint32_t));
+
+    return buffer;
+}
+
+nlohmann::json row_codec::decode(const uint8_t* p, size_t size) const
+{
+    uint16_t count;
+    const uint8_t* offsets;
+    _read_header(p, size, count, offsets);
+
+    auto row = nlohmann::json::object();
+
+    for(uint16_t i = 0; i < count; ++i)
+    {
+        auto begin = _offset(offsets, i), end = _offset(offsets, i + 1);
+        if(end > begin)
+        {
+            if(i >= _columns.size())
+                throw runtime_error("Binary row has an unknown column id.");
+
+            row[_columns[i]] = nlohmann::json::from_msgpack(p + begin, end - begin);
+        }
+    }
+
+    auto overflowBegin = _offset(offsets, count);
+    if(size > overflowBegin)
+    {
+        auto overflow = nlohmann::json::from_msgpack(p + overflowBegin, size - overflowBegin);
+        for(auto it = overflow.begin(); it != overflow.end(); ++it)
+            row[it.key()] = it.value();
+    }
+
+    return row;
+}
+
+bool row_codec::field(const uint8_t* p, size_t size, const string& name, nlohmann::json& val) const
+{
+    uint16_t count;
+    const uint8_t* offsets;
+    _read_header(p, size, count, offsets);
+
+    auto found = _ids.find(name);
+    if(found != _ids.end())
+    {
+        if(found->second >= count)
+            return false;
+
+        auto begin = _offset(offsets, found->second), end = _offset(offsets, found->second + 1);
+        if(end == begin)
+            return false;
+
+        val = nlohmann::json::from_msgpack(p + begin, end - begin);
+        return true;
+    }
+
+    auto overflowBegin = _offset(offsets, count);
+    if(size == overflowBegin)
+        return false;
+
+    auto overflow = nlohmann::json::from_msgpack(p + overflowBegin, size - overflowBegin);
+    auto ofound = overflow.find(name);
+    if(ofound == overflow.end())
+        return false;
+
+    val = *ofound;
+    return true;
+}
+
+void row_codec::_read_header(const uint8_t* p, size_t size, uint16_t& count, const uint8_t*& offsets)
+{
+    if(size < sizeof(count))
+        throw runtime_error("Truncated binary row.");
+
+    memcpy(&count, p, sizeof(count));
+
+    size_t headerSize = sizeof(count) + ((count + 1) * sizeof(uint32_t));
+    if(size < headerSize)
+        throw runtime_error("Truncated binary row.");
+
+    offsets = p + sizeof(count);
+
+    if(_offset(offsets, count) > size)
+        throw runtime_error("Malformed binary row.");
+}
+
+uint32_t row_codec::_offset(const uint8_t* offsets, size_t i)
+{
+    uint32_t offset;
+    memcpy(&offset, offsets + (i * sizeof(offset)), sizeof(offset));
+    return offset;
+}
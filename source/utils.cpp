@@ -1,6 +1,7 @@
 
 #include "tables/utils.h"
 #include <cstdarg>
+#include <cstring>
 #include <map>
 
 using namespace tables;
@@ -77,6 +78,162 @@ string tables::uint64_to_s(uint64_t val)
     return format("%lu", val);
 }
 
+void tables::encode_varint(string& buffer, uint64_t val)
+{
+    while(val >= 0x80)
+    {
+        buffer.push_back((char)((val & 0x7f) | 0x80));
+        val >>= 7;
+    }
+
+    buffer.push_back((char)val);
+}
+
+uint64_t tables::decode_varint(const uint8_t*& p, const uint8_t* end)
+{
+    uint64_t val = 0;
+    int shift = 0;
+
+    while(p < end && shift < 64)
+    {
+        uint8_t b = *p++;
+        val |= ((uint64_t)(b & 0x7f)) << shift;
+        if((b & 0x80) == 0)
+            return val;
+        shift += 7;
+    }
+
+    throw runtime_error("Malformed varint in key.");
+}
+
+void tables::encode_key_string(string& buffer, const string& val)
+{
+    for(auto c : val)
+    {
+        buffer.push_back(c);
+        if(c == '\0')
+            buffer.push_back((char)0xff);
+    }
+
+    buffer.push_back('\0');
+    buffer.push_back((char)0x01);
+}
+
+string tables::decode_key_string(const uint8_t*& p, const uint8_t* end)
+{
+    string val;
+
+    while(p < end)
+    {
+        uint8_t b = *p++;
+
+        if(b == 0)
+        {
+            if(p >= end)
+                break;
+
+            b = *p++;
+
+            if(b == 0xff)
+                val.push_back('\0');
+            else if(b == 0x01)
+                return val;
+            else break;
+        }
+        else val.push_back((char)b);
+    }
+
+    throw runtime_error("Malformed string in key.");
+}
+
+void tables::encode_key_uint64(string& buffer, uint64_t val)
+{
+    for(int shift = 56; shift >= 0; shift -= 8)
+        buffer.push_back((char)((val >> shift) & 0xff));
+}
+
+uint64_t tables::decode_key_uint64(const uint8_t*& p, const uint8_t* end)
+{
+    if(end - p < 8)
+        throw runtime_error("Truncated uint64 in key.");
+
+    uint64_t val = 0;
+    for(int i = 0; i < 8; ++i)
+        val = (val << 8) | *p++;
+
+    return val;
+}
+
+void tables::encode_key_int64(string& buffer, int64_t val)
+{
+    encode_key_uint64(buffer, ((uint64_t)val) ^ 0x8000000000000000ULL);
+}
+
+void tables::encode_key_double(string& buffer, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    bits = (bits & 0x8000000000000000ULL) ? ~bits : (bits | 0x8000000000000000ULL);
+
+    encode_key_uint64(buffer, bits);
+}
+
+static int _hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static string _parse_hex(const string& hex, bool skipDashes)
+{
+    string bytes;
+    int hi = -1;
+
+    for(auto c : hex)
+    {
+        if(skipDashes && c == '-')
+            continue;
+
+        auto d = _hex_digit(c);
+        if(d < 0)
+            throw runtime_error("Invalid hex digit in: " + hex);
+
+        if(hi < 0)
+            hi = d;
+        else
+        {
+            bytes.push_back((char)((hi << 4) | d));
+            hi = -1;
+        }
+    }
+
+    if(hi >= 0)
+        throw runtime_error("Odd number of hex digits in: " + hex);
+
+    return bytes;
+}
+
+void tables::encode_key_uuid(string& buffer, const string& uuid)
+{
+    auto bytes = _parse_hex(uuid, true);
+
+    if(bytes.length() != 16)
+        throw runtime_error("Malformed uuid: " + uuid);
+
+    buffer += bytes;
+}
+
+void tables::encode_key_hex_bytes(string& buffer, const string& hex)
+{
+    encode_key_string(buffer, _parse_hex(hex, false));
+}
+
 #ifdef _ENABLE_DEBUG
 std::map<std::string, std::string> keyStore;
 
@@ -92,6 +249,15 @@ void tables::dump_keys()
 }
 #endif
 
+void tables::_check_mdb(int rc, const string& msg)
+{
+    if(rc == MDB_MAP_FULL || rc == MDB_MAP_RESIZED)
+        throw map_size_error(msg + ": " + mdb_strerror(rc));
+
+    if(rc != 0)
+        throw runtime_error(msg);
+}
+
 pair<string, string> tables::_getByKey(MDB_cursor* cursor, const string& key)
 {
     MDB_val shimKey, shimVal;
@@ -105,7 +271,20 @@ pair<string, string> tables::_getByKey(MDB_cursor* cursor, const string& key)
     return make_pair(key, string((char*)shimVal.mv_data, shimVal.mv_size));
 }
 
-void tables::_putByKey(MDB_txn* txn, MDB_dbi& dbi, const string& key, const string& val)
+pair<string, string> tables::_getByKey(MDB_txn* txn, MDB_dbi dbi, const string& key)
+{
+    MDB_val shimKey, shimVal;
+
+    shimKey.mv_size = key.length();
+    shimKey.mv_data = const_cast<char*>(key.c_str());
+
+    if(mdb_get(txn, dbi, &shimKey, &shimVal) != 0)
+        throw runtime_error("Unable to locate key.");
+
+    return make_pair(key, string((char*)shimVal.mv_data, shimVal.mv_size));
+}
+
+void tables::_putByKey(MDB_txn* txn, MDB_dbi dbi, const string& key, const string& val, unsigned int flags)
 {
 #ifdef _ENABLE_DEBUG
     keyStore[key] = val;
@@ -119,11 +298,25 @@ void tables::_putByKey(MDB_txn* txn, MDB_dbi& dbi, const string& key, const stri
     valShim.mv_size = val.length();
     valShim.mv_data = const_cast<char*>(val.c_str());
 
-    if(mdb_put(txn, dbi, &keyShim, &valShim, 0) != 0)
-        throw runtime_error(("Unable to mdb_put() " + key));
+    _check_mdb(mdb_put(txn, dbi, &keyShim, &valShim, flags), "Unable to mdb_put() " + key);
+}
+
+uint8_t* tables::_reserveByKey(MDB_txn* txn, MDB_dbi dbi, const string& key, size_t size, unsigned int flags)
+{
+    MDB_val keyShim;
+    keyShim.mv_size = key.length();
+    keyShim.mv_data = const_cast<char*>(key.c_str());
+
+    MDB_val valShim;
+    valShim.mv_size = size;
+    valShim.mv_data = NULL;
+
+    _check_mdb(mdb_put(txn, dbi, &keyShim, &valShim, flags | MDB_RESERVE), "Unable to mdb_put() " + key);
+
+    return (uint8_t*)valShim.mv_data;
 }
 
-void tables::_removeByKey(MDB_txn* txn, MDB_dbi& dbi, const string& key)
+void tables::_removeByKey(MDB_txn* txn, MDB_dbi dbi, const string& key)
 {
 #ifdef _ENABLE_DEBUG
     keyStore.erase(key);
@@ -133,6 +326,18 @@ void tables::_removeByKey(MDB_txn* txn, MDB_dbi& dbi, const string& key)
     keyShim.mv_size = key.length();
     keyShim.mv_data = const_cast<char*>(key.c_str());
 
-    if(mdb_del(txn, dbi, &keyShim, NULL) != 0)
-        throw runtime_error(("Unable to mdb_del() " + key));
+    _check_mdb(mdb_del(txn, dbi, &keyShim, NULL), "Unable to mdb_del() " + key);
+}
+
+void tables::_removeByKey(MDB_txn* txn, MDB_dbi dbi, const string& key, const string& val)
+{
+    MDB_val keyShim;
+    keyShim.mv_size = key.length();
+    keyShim.mv_data = const_cast<char*>(key.c_str());
+
+    MDB_val valShim;
+    valShim.mv_size = val.length();
+    valShim.mv_data = const_cast<char*>(val.c_str());
+
+    _check_mdb(mdb_del(txn, dbi, &keyShim, &valShim), "Unable to mdb_del() " + key);
 }
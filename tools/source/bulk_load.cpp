@@ -0,0 +1,83 @@
+
+#include "tables/json_database.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace tables;
+
+static void _usage()
+{
+    fprintf(stderr, "Usage: tables_bulk_load [--schema <schema.json> --size <bytes>] <database> <table> [<rows.jsonl>]\n"
+                    "\n"
+                    "Loads newline separated JSON rows (from stdin if no rows file is given) into an empty table.\n"
+                    "With --schema the database is created first (--size is its map size, default 1 GB).\n");
+}
+
+static string _read_file(const string& fileName)
+{
+    ifstream f(fileName);
+    if(!f)
+        throw runtime_error("Unable to open " + fileName);
+
+    stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+int main(int argc, char* argv[])
+{
+    string schemaFile;
+    uint64_t size = 1024 * 1024 * 1024;
+    vector<string> args;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+
+        if(arg == "--schema" && i + 1 < argc)
+            schemaFile = argv[++i];
+        else if(arg == "--size" && i + 1 < argc)
+            size = s_to_uint64(argv[++i]);
+        else if(arg == "-h" || arg == "--help")
+        {
+            _usage();
+            return 0;
+        }
+        else args.push_back(arg);
+    }
+
+    if(args.size() < 2 || args.size() > 3)
+    {
+        _usage();
+        return 1;
+    }
+
+    try
+    {
+        if(!schemaFile.empty())
+            json_database::create_database(args[0], size, _read_file(schemaFile));
+
+        uint64_t count;
+
+        if(args.size() == 3)
+        {
+            ifstream rows(args[2]);
+            if(!rows)
+                throw runtime_error("Unable to open " + args[2]);
+
+            count = json_database::bulk_load(args[0], args[1], rows);
+        }
+        else count = json_database::bulk_load(args[0], args[1], cin);
+
+        printf("Loaded %lu rows into %s.\n", count, args[1].c_str());
+    }
+    catch(exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+
+#include "tables/json_database.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+using namespace tables;
+
+// Every heap allocation in this program goes through here, so the scan below can show that stepping
+// an iterator never allocates.
+static atomic<uint64_t> _allocations {0};
+
+static void* _allocate(size_t size)
+{
+    ++_allocations;
+    auto p = malloc((size > 0) ? size : 1);
+    if(!p)
+        throw bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return _allocate(size); }
+void* operator new[](size_t size) { return _allocate(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept { try { return _allocate(size); } catch(...) { return NULL; } }
+void* operator new[](size_t size, const nothrow_t&) noexcept { try { return _allocate(size); } catch(...) { return NULL; } }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { free(p); }
+
+static void _usage()
+{
+    fprintf(stderr, "Usage: tables_iterator_bench [--rows <count>] <database>\n"
+                    "\n"
+                    "Creates a database with one indexed table of <count> rows (default 1000000), then scans\n"
+                    "its index forwards and backwards, reporting the time and heap allocations per step.\n");
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t numRows = 1000000;
+    vector<string> args;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+
+        if(arg == "--rows" && i + 1 < argc)
+            numRows = s_to_uint64(argv[++i]);
+        else if(arg == "-h" || arg == "--help")
+        {
+            _usage();
+            return 0;
+        }
+        else args.push_back(arg);
+    }
+
+    if(args.size() != 1 || numRows == 0)
+    {
+        _usage();
+        return 1;
+    }
+
+    try
+    {
+        json_database::create_database(args[0], 16 * 1024 * 1024,
+                                       "[ { \"table_name\": \"segments\", "
+                                           "\"index_columns\": [ \"start_time\" ], "
+                                           "\"column_types\": { \"start_time\": \"timestamp\" } } ]");
+
+        json_database db(args[0]);
+
+        for(uint64_t done = 0; done < numRows;)
+        {
+            vector<string> rows;
+            for(; rows.size() < 10000 && done < numRows; ++done)
+                rows.push_back("{ \"start_time\": " + to_string(done) + " }");
+
+            db.transaction([&](trans_state& ts){
+                db.insert_json_batch(ts, "segments", rows);
+            });
+        }
+
+        auto iter = db.get_iterator("segments", "start_time");
+
+        uint64_t steps = 0, pkSum = 0, bytes = 0;
+
+        auto before = _allocations.load();
+        auto start = chrono::steady_clock::now();
+
+        for(; iter.valid(); iter.next(), ++steps)
+        {
+            pkSum += iter.current_pk();
+            bytes += iter.current_key_view().size() + iter.current_data_view().size();
+        }
+
+        auto forwardTime = chrono::steady_clock::now() - start;
+        auto forwardAllocations = _allocations.load() - before;
+
+        iter.find((int64_t)(numRows - 1));
+
+        before = _allocations.load();
+        start = chrono::steady_clock::now();
+
+        for(; iter.valid(); iter.prev(), ++steps)
+            pkSum -= iter.current_pk();
+
+        auto reverseTime = chrono::steady_clock::now() - start;
+        auto reverseAllocations = _allocations.load() - before;
+
+        if(steps != 2 * numRows || pkSum != 0 || bytes == 0)
+            throw runtime_error("Scan didn't visit every row.");
+
+        auto ns_per_step = [&](chrono::steady_clock::duration d) {
+            return (double)chrono::duration_cast<chrono::nanoseconds>(d).count() / numRows;
+        };
+
+        printf("next(): %.1f ns/step, %lu allocations over %lu steps.\n", ns_per_step(forwardTime), forwardAllocations, numRows);
+        printf("prev(): %.1f ns/step, %lu allocations over %lu steps.\n", ns_per_step(reverseTime), reverseAllocations, numRows);
+
+        if(forwardAllocations != 0 || reverseAllocations != 0)
+        {
+            fprintf(stderr, "Stepping allocated.\n");
+            return 1;
+        }
+    }
+    catch(exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -15,6 +15,32 @@ public:
         TEST(json_database_test::test_compound_indexes);
         TEST(json_database_test::test_iterator_at_beginning);
         TEST(json_database_test::test_mt_db);
+        TEST(json_database_test::test_table_name_prefixes);
+        TEST(json_database_test::test_pk_order);
+        TEST(json_database_test::test_duplicate_index_values);
+        TEST(json_database_test::test_typed_indexes);
+        TEST(json_database_test::test_covering_indexes);
+        TEST(json_database_test::test_binary_rows);
+        TEST(json_database_test::test_compression);
+        TEST(json_database_test::test_pk_counters);
+        TEST(json_database_test::test_insert_json_batch);
+        TEST(json_database_test::test_bulk_load);
+        TEST(json_database_test::test_bulk_load_map_growth);
+        TEST(json_database_test::test_insert_from_buffer);
+        TEST(json_database_test::test_json_extractor);
+        TEST(json_database_test::test_insert_with_extractor);
+        TEST(json_database_test::test_update_json);
+        TEST(json_database_test::test_group_commit);
+        TEST(json_database_test::test_durability_modes);
+        TEST(json_database_test::test_map_growth);
+        TEST(json_database_test::test_remove_range);
+        TEST(json_database_test::test_remove_with_footprint);
+        TEST(json_database_test::test_ttl_expiry);
+        TEST(json_database_test::test_savepoints);
+        TEST(json_database_test::test_data_views);
+        TEST(json_database_test::test_iterator_stepping);
+        TEST(json_database_test::test_find_range);
+        TEST(json_database_test::test_embedded_nul_keys);
     TEST_SUITE_END();
 
     virtual ~json_database_test() throw() {}
@@ -32,4 +58,30 @@ public:
     void test_compound_indexes();
     void test_iterator_at_beginning();
     void test_mt_db();
+    void test_table_name_prefixes();
+    void test_pk_order();
+    void test_duplicate_index_values();
+    void test_typed_indexes();
+    void test_covering_indexes();
+    void test_binary_rows();
+    void test_compression();
+    void test_pk_counters();
+    void test_insert_json_batch();
+    void test_bulk_load();
+    void test_bulk_load_map_growth();
+    void test_insert_from_buffer();
+    void test_json_extractor();
+    void test_insert_with_extractor();
+    void test_update_json();
+    void test_group_commit();
+    void test_durability_modes();
+    void test_map_growth();
+    void test_remove_range();
+    void test_remove_with_footprint();
+    void test_ttl_expiry();
+    void test_savepoints();
+    void test_data_views();
+    void test_iterator_stepping();
+    void test_find_range();
+    void test_embedded_nul_keys();
 };
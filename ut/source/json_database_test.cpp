@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <set>
+#include <sstream>
 
 using namespace std;
 using namespace tables;
@@ -57,6 +59,13 @@ void json_database_test::test_create()
     UT_ASSERT( db._schema["segments"].index_columns.size() == 0 );
     found = std::find( db._schema["segments"].regular_columns.begin(), db._schema["segments"].regular_columns.end(), "sdp" );
     UT_ASSERT( found != db._schema["segments"].regular_columns.end() );
+    // Every table and every index gets its own sub-database.
+    UT_ASSERT( db._schema["segment_files"].indexes.size() == 3 );
+    UT_ASSERT( db._schema["segments"].indexes.size() == 0 );
+    set<MDB_dbi> dbis = { db._schema["segment_files"].dbi, db._schema["segments"].dbi };
+    for( auto& ii : db._schema["segment_files"].indexes )
+        dbis.insert( ii.dbi );
+    UT_ASSERT( dbis.size() == 5 );
 }
 
 void json_database_test::test_basic_insert()
@@ -67,7 +76,8 @@ void json_database_test::test_basic_insert()
 
     json_database db( "test.db" );
 
-    string val, pk1;
+    string val;
+    uint64_t pk1;
     db.transaction([&](trans_state& ts){
         val = "{ \"time\": \"1234\" }";
         pk1 = db.insert_json( ts, "segments", val );
@@ -91,7 +101,8 @@ void json_database_test::test_basic_iteration()
 
     json_database db( "test.db" );
 
-    string val1, val2, val3, val4, val5, val6, val7, pk1, pk2, pk3, pk4, pk5, pk6, pk7;
+    string val1, val2, val3, val4, val5, val6, val7;
+    uint64_t pk1, pk2, pk3, pk4, pk5, pk6, pk7;
 
     db.transaction([&](trans_state& ts) {
         val1 = "{ \"time\": \"100\" }";
@@ -152,7 +163,8 @@ void json_database_test::test_primary_key_iteration()
 
     json_database db( "test.db" );
 
-    string val1, val2, val3, val4, val5, val6, val7, pk1, pk2, pk3, pk4, pk5, pk6, pk7;
+    string val1, val2, val3, val4, val5, val6, val7;
+    uint64_t pk1, pk2, pk3, pk4, pk5, pk6, pk7;
 
     db.transaction([&](trans_state& ts) {
 
@@ -214,7 +226,8 @@ void json_database_test::test_multiple_indexes()
 
     json_database db( "test.db" );
 
-    string val1, val2, val3, val4, val5, val6, val7, pk1, pk2, pk3, pk4, pk5, pk6, pk7;
+    string val1, val2, val3, val4, val5, val6, val7;
+    uint64_t pk1, pk2, pk3, pk4, pk5, pk6, pk7;
 
     db.transaction([&](trans_state& ts) {
         val1 = "{ \"time\": \"100\", \"index\": \"7\" }";
@@ -278,7 +291,7 @@ void json_database_test::test_swmr()
     bool writerRunning = true;
     uint32_t writerIndex = 0;
 
-    vector<string> priKeys;
+    vector<uint64_t> priKeys;
 
     thread wt([&](){
         while( writerRunning )
@@ -312,8 +325,8 @@ void json_database_test::test_swmr()
                 iter.find( target );
                 if( iter.valid() )
                 {
-                    string key = iter.current_pk();
-                    UT_ASSERT( !key.empty() );
+                    auto key = iter.current_pk();
+                    UT_ASSERT( key != 0 );
                     ++r1Reads;
                     ut_usleep( 1000 );
                 }
@@ -333,8 +346,8 @@ void json_database_test::test_swmr()
                 iter.find( target );
                 if( iter.valid() )
                 {
-                    string key = iter.current_pk();
-                    UT_ASSERT( !key.empty() );
+                    auto key = iter.current_pk();
+                    UT_ASSERT( key != 0 );
                     ++r2Reads;
                     ut_usleep( 1000 );
                 }
@@ -381,7 +394,7 @@ void json_database_test::test_mwmr()
     vector<writer_context> writerContexts( NUM_THREADS );
 
     std::recursive_mutex pkLok;
-    vector<string> priKeys;
+    vector<uint64_t> priKeys;
 
     for(int i = 0; i < NUM_THREADS; ++i)
     {
@@ -393,7 +406,6 @@ void json_database_test::test_mwmr()
             {
                 try
                 {
-                    // XXX write threads are putting the same start_time's in!
                     db.transaction([&](trans_state& ts) {
                         string val = "{ \"start_time\": \"" + to_string(writerContexts[i].start_time) + "\", \"end_time\": \"" + to_string(writerContexts[i].start_time) + "\" }";
                         std::unique_lock<std::recursive_mutex> g(pkLok);
@@ -439,8 +451,8 @@ void json_database_test::test_mwmr()
                     iter.find( target );
                     if( iter.valid() )
                     {
-                        string key = iter.current_pk();
-                        UT_ASSERT( !key.empty() );
+                        auto key = iter.current_pk();
+                        UT_ASSERT( key != 0 );
                         ++rc.reads;
                         ut_usleep( 1 );
                     }
@@ -488,7 +500,8 @@ void json_database_test::test_compound_indexes()
 
     json_database db( "test.db" );
 
-    string val1, val2, val3, pk1, pk2, pk3;
+    string val1, val2, val3;
+    uint64_t pk1, pk2, pk3;
 
     db.transaction([&](trans_state& ts) {
         val1 = "{ \"time\": \"100\", \"index\": \"7\" }";
@@ -523,7 +536,8 @@ void json_database_test::test_iterator_at_beginning()
 
     json_database db( "test.db" );
 
-    string val1, val2, val3, val4, val5, val6, val7, pk1, pk2, pk3, pk4, pk5, pk6, pk7;
+    string val1, val2, val3, val4, val5, val6, val7;
+    uint64_t pk1, pk2, pk3, pk4, pk5, pk6, pk7;
 
     db.transaction([&](trans_state& ts) {
         val1 = "{ \"time\": \"100\", \"index\": \"7\" }";
@@ -642,3 +656,1713 @@ void json_database_test::test_mt_db()
     fflush(stdout);
 
 }
+
+void json_database_test::test_table_name_prefixes()
+{
+    std::string schema = "[ { \"table_name\": \"seg\", \"index_columns\": [ \"time\" ] }, "
+                           "{ \"table_name\": \"segments\", \"index_columns\": [ \"time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    string val1, val2;
+    uint64_t pk1, pk2;
+
+    db.transaction([&](trans_state& ts) {
+        val1 = "{ \"time\": \"100\" }";
+        pk1 = db.insert_json( ts, "segments", val1);
+
+        val2 = "{ \"time\": \"a\\u0000b\" }";
+        pk2 = db.insert_json( ts, "segments", val2);
+    });
+
+    {
+        // "seg" is a prefix of "segments" but must not see any of its rows.
+        auto iter = db.get_iterator( "seg", "time" );
+        UT_ASSERT( !iter.valid() );
+
+        auto pkIter = db.get_pk_iterator( "seg" );
+        UT_ASSERT( !pkIter.valid() );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", "time" );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pk1 );
+
+        iter.find( string("a\0b", 3) );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pk2 );
+        UT_ASSERT( iter.current_data() == val2 );
+    }
+
+    UT_ASSERT_THROWS( db.get_iterator( "segments", "missing" ), std::runtime_error );
+
+    db.transaction([&](trans_state& ts) {
+        db.remove(ts, "segments", pk1);
+        db.remove(ts, "segments", pk2);
+    });
+
+    auto iter = db.get_pk_iterator( "segments" );
+    UT_ASSERT( !iter.valid() );
+}
+
+void json_database_test::test_pk_order()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    vector<uint64_t> pks;
+
+    db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 25; ++i )
+            pks.push_back( db.insert_json( ts, "segments", "{ \"time\": \"" + to_string(i) + "\" }" ) );
+    });
+
+    // pk's past 9 must still iterate in numeric order.
+    auto iter = db.get_pk_iterator( "segments" );
+    for( auto pk : pks )
+    {
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pk );
+        iter.next();
+    }
+    UT_ASSERT( !iter.valid() );
+
+    iter.find( pks[10] );
+    UT_ASSERT( iter.valid() );
+    UT_ASSERT( iter.current_data() == "{ \"time\": \"10\" }" );
+
+    iter.prev();
+    UT_ASSERT( iter.valid() );
+    UT_ASSERT( iter.current_pk() == pks[9] );
+
+    UT_ASSERT_THROWS( iter.find( string("10") ), std::runtime_error );
+
+    auto idx = db.get_iterator( "segments", "time" );
+    idx.find( "12" );
+    UT_ASSERT( idx.valid() );
+    UT_ASSERT( idx.current_pk() == pks[12] );
+}
+
+void json_database_test::test_duplicate_index_values()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    vector<uint64_t> dupPKs;
+    uint64_t beforePK, afterPK;
+
+    db.transaction([&](trans_state& ts) {
+        beforePK = db.insert_json( ts, "segments", "{ \"time\": \"100\" }" );
+        for( int i = 0; i < 1000; ++i )
+            dupPKs.push_back( db.insert_json( ts, "segments", "{ \"time\": \"200\" }" ) );
+        afterPK = db.insert_json( ts, "segments", "{ \"time\": \"300\" }" );
+    });
+
+    {
+        // Stepping visits every row with a duplicated value, in pk order.
+        auto iter = db.get_iterator( "segments", "time" );
+        iter.find( "200" );
+        for( auto pk : dupPKs )
+        {
+            UT_ASSERT( iter.valid() );
+            UT_ASSERT( iter.current_pk() == pk );
+            iter.next();
+        }
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == afterPK );
+    }
+
+    {
+        // Batches return all of a value's pks and leave us ready to move on to the next value.
+        auto iter = db.get_iterator( "segments", "time" );
+        iter.find( "200" );
+        iter.next();
+
+        vector<uint64_t> found;
+        iter.current_pks([&](const uint64_t* pks, size_t count){
+            found.insert( found.end(), pks, pks + count );
+        });
+        UT_ASSERT( found == dupPKs );
+
+        iter.next();
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == afterPK );
+
+        iter.find( "100" );
+        found.clear();
+        iter.current_pks([&](const uint64_t* pks, size_t count){
+            found.insert( found.end(), pks, pks + count );
+        });
+        UT_ASSERT( found.size() == 1 );
+        UT_ASSERT( found[0] == beforePK );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        db.remove( ts, "segments", dupPKs[500] );
+    });
+    dupPKs.erase( dupPKs.begin() + 500 );
+
+    auto iter = db.get_iterator( "segments", "time" );
+    iter.find( "200" );
+    vector<uint64_t> found;
+    iter.current_pks([&](const uint64_t* pks, size_t count){
+        found.insert( found.end(), pks, pks + count );
+    });
+    UT_ASSERT( found == dupPKs );
+}
+
+void json_database_test::test_typed_indexes()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"offset\", \"size\", \"segment_id\" ], "
+                             "\"compound_indexes\": [ [ \"segment_id\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\", \"offset\": \"double\", "
+                                                 "\"size\": \"uint64\", \"segment_id\": \"uuid\" } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    UT_ASSERT( db._schema["segments"].indexes[0].types[0] == column_type::TIMESTAMP );
+
+    const string id1 = "e130c4f6-a12c-4152-8f7f-4f59173fb492";
+    const string id2 = "f130c4f6-a12c-4152-8f7f-4f59173fb492";
+
+    // Values with different numbers of digits, negatives and numeric strings all sort numerically.
+    vector<string> rows = {
+        "{ \"start_time\": 1469397588523, \"offset\": 2.5, \"size\": 100, \"segment_id\": \"" + id1 + "\" }",
+        "{ \"start_time\": 9, \"offset\": -10.25, \"size\": 9, \"segment_id\": \"" + id2 + "\" }",
+        "{ \"start_time\": -5, \"offset\": -0.5, \"size\": 18446744073709551615, \"segment_id\": \"" + id1 + "\" }",
+        "{ \"start_time\": \"70\", \"offset\": 1e10, \"size\": \"1000\", \"segment_id\": \"" + id2 + "\" }"
+    };
+
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        for( auto& r : rows )
+            pks.push_back( db.insert_json( ts, "segments", r ) );
+    });
+
+    auto order = [&](const string& index) {
+        vector<uint64_t> found;
+        for( auto iter = db.get_iterator( "segments", index ); iter.valid(); iter.next() )
+            found.push_back( iter.current_pk() );
+        return found;
+    };
+
+    UT_ASSERT( order( "start_time" ) == vector<uint64_t>({ pks[2], pks[1], pks[3], pks[0] }) );
+    UT_ASSERT( order( "offset" ) == vector<uint64_t>({ pks[1], pks[2], pks[0], pks[3] }) );
+    UT_ASSERT( order( "size" ) == vector<uint64_t>({ pks[1], pks[0], pks[3], pks[2] }) );
+
+    {
+        auto iter = db.get_iterator( "segments", "start_time" );
+
+        iter.find( 10 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[3] );
+
+        iter.find( (int64_t)-100 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[2] );
+
+        iter.find( "1469397588523" );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_data() == rows[0] );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", "offset" );
+        iter.find( -1.0 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[2] );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", vector<string>{ "segment_id", "start_time" } );
+
+        iter.find( vector<nlohmann::json>{ id2, 10 } );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[3] );
+
+        iter.find( id1 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[2] );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT_THROWS( db.insert_json( ts, "segments", "{ \"start_time\": 1, \"offset\": 1, \"size\": 1, \"segment_id\": \"nope\" }" ), std::runtime_error );
+    });
+
+    db.transaction([&](trans_state& ts) {
+        for( auto pk : pks )
+            db.remove( ts, "segments", pk );
+    });
+
+    UT_ASSERT( !db.get_pk_iterator( "segments" ).valid() );
+    UT_ASSERT( !db.get_iterator( "segments", "offset" ).valid() );
+}
+
+void json_database_test::test_covering_indexes()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"sdp\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" }, "
+                             "\"index_includes\": { \"start_time\": [ \"end_time\", \"file_name\" ] } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    UT_ASSERT_THROWS( json_database::create_database( "bad.db", 16 * (1024*1024),
+                      "[ { \"table_name\": \"t\", \"index_columns\": [ \"a\" ], \"index_includes\": { \"b\": [ \"c\" ] } } ]" ),
+                      std::runtime_error );
+    ut_file_unlink( "bad.db" );
+
+    json_database db( "test.db" );
+
+    UT_ASSERT( db._schema["segments"].indexes[0].include == vector<string>({ "end_time", "file_name" }) );
+    UT_ASSERT( db._schema["segments"].indexes[1].include.empty() );
+
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 100; ++i )
+        {
+            // Every other row shares its start_time with its neighbor.
+            auto row = tables::format( "{ \"start_time\": %d, \"end_time\": %d, \"file_name\": \"%d.mp4\", \"sdp\": \"video\" }", i / 2, i + 100, i );
+            pks.push_back( db.insert_json( ts, "segments", row ) );
+        }
+    });
+
+    {
+        auto iter = db.get_iterator( "segments", "start_time" );
+
+        iter.find( 10 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[20] );
+
+        auto payload = iter.current_index_payload();
+        UT_ASSERT( payload["end_time"].get<int>() == 120 );
+        UT_ASSERT( payload["file_name"].get<string>() == "20.mp4" );
+        UT_ASSERT( payload.find( "sdp" ) == payload.end() );
+
+        UT_ASSERT( nlohmann::json::parse( iter.current_data() )["file_name"].get<string>() == "20.mp4" );
+
+        vector<uint64_t> dups;
+        iter.current_pks([&](const uint64_t* p, size_t n) { dups.insert( dups.end(), p, p + n ); });
+        UT_ASSERT( dups == vector<uint64_t>({ pks[20], pks[21] }) );
+
+        int n = 0;
+        for( iter.find( 0 ); iter.valid(); iter.next(), ++n )
+            UT_ASSERT( iter.current_index_payload()["end_time"].get<int>() == n + 100 );
+        UT_ASSERT( n == 100 );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", "sdp" );
+        UT_ASSERT_THROWS( iter.current_index_payload(), std::runtime_error );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        for( auto pk : pks )
+            db.remove( ts, "segments", pk );
+    });
+
+    UT_ASSERT( !db.get_iterator( "segments", "start_time" ).valid() );
+}
+
+void json_database_test::test_binary_rows()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"regular_columns\": [ \"sdp\" ], "
+                             "\"index_columns\": [ \"start_time\", \"segment_id\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\", \"segment_id\": \"uuid\" }, "
+                             "\"index_includes\": { \"start_time\": [ \"end_time\" ] }, "
+                             "\"row_format\": \"binary\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    UT_ASSERT_THROWS( json_database::create_database( "bad.db", 16 * (1024*1024),
+                      "[ { \"table_name\": \"t\", \"row_format\": \"xml\" } ]" ),
+                      std::runtime_error );
+    ut_file_unlink( "bad.db" );
+
+    json_database db( "test.db" );
+
+    UT_ASSERT( db._schema["segments"].binary_rows );
+    UT_ASSERT( db._schema["segments"].codec.columns() == vector<string>({ "sdp", "start_time", "end_time", "segment_id" }) );
+
+    const string id = "e130c4f6-a12c-4152-8f7f-4f59173fb492";
+
+    vector<nlohmann::json> rows;
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 10; ++i )
+        {
+            nlohmann::json row = { { "start_time", 1000 + i }, { "end_time", 2000 + i }, { "segment_id", id },
+                                   { "sdp", "v=0\r\no=- 0 0 IN IP4 127.0.0.1\r\n" }, { "file_name", tables::format( "%d.mp4", i ) } };
+
+            // Absent columns and fields the schema doesn't know about both round trip.
+            if( i % 2 )
+                row.erase( "sdp" );
+
+            rows.push_back( row );
+            pks.push_back( db.insert_json( ts, "segments", row.dump() ) );
+        }
+    });
+
+    {
+        auto iter = db.get_pk_iterator( "segments" );
+
+        for( size_t i = 0; i < rows.size(); ++i, iter.next() )
+        {
+            UT_ASSERT( iter.valid() );
+            UT_ASSERT( nlohmann::json::parse( iter.current_data() ) == rows[i] );
+            UT_ASSERT( iter.current_field( "file_name" ) == rows[i]["file_name"] );
+            UT_ASSERT( iter.current_field( "sdp" ).is_null() == (i % 2 == 1) );
+            UT_ASSERT( iter.current_field( "nope" ).is_null() );
+        }
+
+        UT_ASSERT( !iter.valid() );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", "start_time" );
+        iter.find( 1005 );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_pk() == pks[5] );
+        UT_ASSERT( iter.current_field( "start_time" ).get<int>() == 1005 );
+        UT_ASSERT( iter.current_index_payload()["end_time"].get<int>() == 2005 );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        for( auto pk : pks )
+            db.remove( ts, "segments", pk );
+    });
+
+    UT_ASSERT( !db.get_pk_iterator( "segments" ).valid() );
+    UT_ASSERT( !db.get_iterator( "segments", "start_time" ).valid() );
+    UT_ASSERT( !db.get_iterator( "segments", "segment_id" ).valid() );
+}
+
+void json_database_test::test_compression()
+{
+    {
+        // Round trips, with and without a dictionary, including incompressible and empty input.
+        string text = "{ \"sdp\": \"v=0\\r\\no=- 0 0 IN IP4 127.0.0.1\\r\\ns=stream\\r\\nm=video 0 RTP/AVP 96\\r\\n\", \"sdp2\": \"v=0\\r\\no=- 0 0 IN IP4 127.0.0.1\\r\\n\" }";
+        string noise;
+        for( int i = 0; i < 1000; ++i )
+            noise.push_back( (char)((i * 7919) ^ (i >> 3) ^ (i * i)) );
+
+        for( auto& dict : vector<string>{ "", "o=- 0 0 IN IP4 127.0.0.1\r\nm=video" } )
+        {
+            for( auto& in : vector<string>{ text, noise, "", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa" } )
+            {
+                auto c = lz_compress( (const uint8_t*)in.data(), in.size(), dict );
+                UT_ASSERT( lz_decompress( (const uint8_t*)c.data(), c.size(), in.size(), dict ) == in );
+            }
+        }
+
+        auto c = lz_compress( (const uint8_t*)text.data(), text.size() );
+        UT_ASSERT( c.size() < text.size() );
+        UT_ASSERT_THROWS( lz_decompress( (const uint8_t*)c.data(), c.size() - 1, text.size() ), std::runtime_error );
+        UT_ASSERT_THROWS( lz_decompress( (const uint8_t*)c.data(), c.size(), text.size() + 1 ), std::runtime_error );
+    }
+
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" }, "
+                             "\"compression\": \"lz\" }, "
+                           "{ \"table_name\": \"plain\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    auto make_row = [](int i) {
+        return tables::format( "{ \"start_time\": %d, \"sdp\": \"v=0\\r\\no=- %d 0 IN IP4 127.0.0.1\\r\\ns=stream\\r\\nm=video 0 RTP/AVP 96\\r\\na=rtpmap:96 H264/90000\\r\\n\" }", i, i );
+    };
+
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT_THROWS( db.train_dictionary( ts, "plain" ), std::runtime_error );
+        UT_ASSERT( db.train_dictionary( ts, "segments" ) == 0 );
+
+        for( int i = 0; i < 100; ++i )
+            pks.push_back( db.insert_json( ts, "segments", make_row( i ) ) );
+    });
+
+    auto before = db.stats( "segments" );
+    UT_ASSERT( before.rows == 100 );
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.train_dictionary( ts, "segments" ) > 0 );
+
+        for( int i = 100; i < 200; ++i )
+            pks.push_back( db.insert_json( ts, "segments", make_row( i ) ) );
+    });
+
+    auto after = db.stats( "segments" );
+    UT_ASSERT( after.rows == 200 );
+    UT_ASSERT( after.data_bytes > before.data_bytes );
+
+    // Rows compressed with the dictionary are much smaller than the ones compressed without it.
+    UT_ASSERT( (after.stored_bytes - before.stored_bytes) < before.stored_bytes / 2 );
+
+    // A dictionary trained by a transaction that never commits mustn't be used by later rows.
+    UT_ASSERT_THROWS( db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 100; ++i )
+            db.insert_json( ts, "segments", tables::format( "{ \"start_time\": %d, \"note\": \"nothing like the others %d\" }", i, i ) );
+        UT_ASSERT( db.train_dictionary( ts, "segments" ) > 0 );
+        throw std::runtime_error( "abort" );
+    }), std::runtime_error );
+
+    db.transaction([&](trans_state& ts) {
+        for( int i = 200; i < 210; ++i )
+            pks.push_back( db.insert_json( ts, "segments", make_row( i ) ) );
+    });
+
+    {
+        // A fresh handle has to find the dictionary in the database.
+        json_database db2( "test.db" );
+
+        int i = 0;
+        for( auto iter = db2.get_iterator( "segments", "start_time" ); iter.valid(); iter.next(), ++i )
+            UT_ASSERT( iter.current_data() == make_row( i ) );
+        UT_ASSERT( i == 210 );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        for( auto pk : pks )
+            db.remove( ts, "segments", pk );
+    });
+
+    UT_ASSERT( db.stats( "segments" ).rows == 0 );
+    UT_ASSERT( !db.get_iterator( "segments", "start_time" ).valid() );
+}
+
+void json_database_test::test_pk_counters()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"start_time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db1( "test.db" );
+    json_database db2( "test.db" );
+
+    auto insert = [](json_database& db, int n) {
+        vector<uint64_t> pks;
+        db.transaction([&](trans_state& ts) {
+            for( int i = 0; i < n; ++i )
+                pks.push_back( db.insert_json( ts, "segments", "{ \"start_time\": \"1\" }" ) );
+        });
+        return pks;
+    };
+
+    // Consecutive transactions on one handle use its in memory counters...
+    UT_ASSERT( insert( db1, 3 ) == vector<uint64_t>({ 1, 2, 3 }) );
+    UT_ASSERT( insert( db1, 2 ) == vector<uint64_t>({ 4, 5 }) );
+
+    // ...but a handle notices when someone else has written since.
+    UT_ASSERT( insert( db2, 2 ) == vector<uint64_t>({ 6, 7 }) );
+    UT_ASSERT( insert( db1, 1 ) == vector<uint64_t>({ 8 }) );
+
+    // A transaction that throws doesn't use up pks.
+    try
+    {
+        db1.transaction([&](trans_state& ts) {
+            db1.insert_json( ts, "segments", "{ \"start_time\": \"1\" }" );
+            throw std::runtime_error( "abort" );
+        });
+    }
+    catch(std::exception&) {}
+
+    UT_ASSERT( insert( db1, 1 ) == vector<uint64_t>({ 9 }) );
+
+    // Transactions that don't insert anything leave the counters alone.
+    db2.transaction([&](trans_state& ts) {
+        db2.remove( ts, "segments", 9 );
+    });
+
+    UT_ASSERT( insert( db1, 1 ) == vector<uint64_t>({ 10 }) );
+
+    json_database db3( "test.db" );
+    UT_ASSERT( insert( db3, 1 ) == vector<uint64_t>({ 11 }) );
+}
+
+void json_database_test::test_insert_json_batch()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"compound_indexes\": [ [ \"camera\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" } } ]";
+
+    json_database::create_database( "test.db", 64 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.insert_json( ts, "segments", "{ \"start_time\": 5000, \"camera\": \"a\" }" ) == 1 );
+        UT_ASSERT( db.insert_json_batch( ts, "segments", vector<string>() ) == make_pair( (uint64_t)0, (uint64_t)0 ) );
+    });
+
+    // Rows arrive with start_times in reverse order, spread over a few cameras.
+    const int N = 10000;
+    vector<string> rows;
+    for( int i = 0; i < N; ++i )
+        rows.push_back( tables::format( "{ \"start_time\": %d, \"camera\": \"%c\" }", N - i, 'a' + (i % 4) ) );
+
+    pair<uint64_t, uint64_t> range;
+    db.transaction([&](trans_state& ts) {
+        range = db.insert_json_batch( ts, "segments", rows );
+    });
+
+    UT_ASSERT( range.first == 2 );
+    UT_ASSERT( range.second == N + 1 );
+
+    {
+        auto iter = db.get_pk_iterator( "segments" );
+        iter.find( range.first + 17 );
+        UT_ASSERT( iter.current_data() == rows[17] );
+    }
+
+    {
+        // Equal start_times keep their pks in order.
+        int n = 0;
+        int64_t lastTime = 0;
+        for( auto iter = db.get_iterator( "segments", "start_time" ); iter.valid(); iter.next(), ++n )
+        {
+            auto t = nlohmann::json::parse( iter.current_data() )["start_time"].get<int64_t>();
+            UT_ASSERT( t >= lastTime );
+            lastTime = t;
+        }
+        UT_ASSERT( n == N + 1 );
+    }
+
+    {
+        auto iter = db.get_iterator( "segments", vector<string>{ "camera", "start_time" } );
+        iter.find( vector<nlohmann::json>{ "b", 0 } );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_data() == rows[N - 3] );
+
+        vector<uint64_t> pks;
+        iter = db.get_iterator( "segments", "camera" );
+        iter.find( "a" );
+        iter.current_pks([&](const uint64_t* p, size_t n) { pks.insert( pks.end(), p, p + n ); });
+        UT_ASSERT( pks.size() == (N / 4) + 1 );
+        UT_ASSERT( std::is_sorted( pks.begin(), pks.end() ) );
+    }
+
+    // A bad row rejects the whole batch before anything is written or any pks are taken.
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT_THROWS( db.insert_json_batch( ts, "segments", vector<string>{ "{ \"start_time\": 1, \"camera\": \"a\" }", "{ \"camera\": \"a\" }" } ), std::runtime_error );
+        UT_ASSERT( db.insert_json( ts, "segments", "{ \"start_time\": 1, \"camera\": \"a\" }" ) == N + 2 );
+    });
+}
+
+void json_database_test::test_bulk_load()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"compound_indexes\": [ [ \"camera\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" }, "
+                             "\"index_includes\": { \"start_time\": [ \"camera\" ] } } ]";
+
+    json_database::create_database( "test.db", 64 * (1024*1024), schema );
+
+    const int N = 5000;
+    std::stringstream source;
+    vector<string> rows;
+    for( int i = 0; i < N; ++i )
+    {
+        rows.push_back( tables::format( "{ \"start_time\": %d, \"camera\": \"%c\" }", (i * 7919) % 1000, 'a' + (i % 3) ) );
+        source << rows.back() << "\n";
+        if( i % 1000 == 0 )
+            source << "\n";
+    }
+
+    // A tiny run size forces lots of runs through the merge.
+    UT_ASSERT( json_database::bulk_load( "test.db", "segments", source, 4096 ) == N );
+
+    {
+        std::stringstream more( rows[0] );
+        UT_ASSERT_THROWS( json_database::bulk_load( "test.db", "segments", more ), std::runtime_error );
+    }
+
+    json_database db( "test.db" );
+
+    {
+        auto iter = db.get_pk_iterator( "segments" );
+        for( int i = 0; i < N; ++i, iter.next() )
+        {
+            UT_ASSERT( iter.current_pk() == (uint64_t)i + 1 );
+            UT_ASSERT( iter.current_data() == rows[i] );
+        }
+        UT_ASSERT( !iter.valid() );
+    }
+
+    {
+        // Every index holds every row, in key order with equal keys in pk order.
+        int n = 0;
+        pair<int64_t, uint64_t> last( -1, 0 );
+        for( auto iter = db.get_iterator( "segments", "start_time" ); iter.valid(); iter.next(), ++n )
+        {
+            pair<int64_t, uint64_t> cur( nlohmann::json::parse( iter.current_data() )["start_time"].get<int64_t>(), iter.current_pk() );
+            UT_ASSERT( cur > last );
+            UT_ASSERT( iter.current_index_payload()["camera"] == nlohmann::json::parse( iter.current_data() )["camera"] );
+            last = cur;
+        }
+        UT_ASSERT( n == N );
+
+        vector<uint64_t> pks;
+        auto iter = db.get_iterator( "segments", "camera" );
+        iter.find( "b" );
+        iter.current_pks([&](const uint64_t* p, size_t n) { pks.insert( pks.end(), p, p + n ); });
+        UT_ASSERT( pks.size() == (N + 1) / 3 );
+        UT_ASSERT( std::is_sorted( pks.begin(), pks.end() ) );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.insert_json( ts, "segments", rows[0] ) == N + 1 );
+    });
+}
+
+void json_database_test::test_bulk_load_map_growth()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" } } ]";
+
+    // Far too small for the load, so both the rows and the index merge have to grow it mid batch.
+    json_database::create_database( "test.db", 1024 * 1024, schema );
+
+    const int N = 20000;
+    std::stringstream source;
+    vector<string> rows;
+    for( int i = 0; i < N; ++i )
+    {
+        rows.push_back( tables::format( "{ \"start_time\": %d, \"camera\": \"%c\", \"note\": \"padding padding padding\" }", i, 'a' + (i % 3) ) );
+        source << rows.back() << "\n";
+    }
+
+    UT_ASSERT( json_database::bulk_load( "test.db", "segments", source, 64 * 1024 ) == N );
+
+    json_database db( "test.db" );
+
+    UT_ASSERT( db.map_size() > 1024 * 1024 );
+    UT_ASSERT( db.stats( "segments" ).rows == N );
+
+    {
+        auto iter = db.get_pk_iterator( "segments" );
+        for( int i = 0; i < N; ++i, iter.next() )
+        {
+            UT_ASSERT( iter.current_pk() == (uint64_t)i + 1 );
+            UT_ASSERT( iter.current_data() == rows[i] );
+        }
+        UT_ASSERT( !iter.valid() );
+    }
+
+    {
+        // start_time is unique, so its index must list exactly the rows in pk order.
+        int n = 0;
+        for( auto iter = db.get_iterator( "segments", "start_time" ); iter.valid(); iter.next(), ++n )
+        {
+            UT_ASSERT( iter.current_pk() == (uint64_t)n + 1 );
+            UT_ASSERT( iter.current_data() == rows[n] );
+        }
+        UT_ASSERT( n == N );
+    }
+
+    {
+        int n = 0;
+        for( auto iter = db.get_iterator( "segments", "camera" ); iter.valid(); iter.next(), ++n )
+        {
+            auto pk = iter.current_pk();
+            UT_ASSERT( pk >= 1 && pk <= (uint64_t)N );
+            UT_ASSERT( iter.current_data() == rows[pk - 1] );
+        }
+        UT_ASSERT( n == N );
+    }
+}
+
+void json_database_test::test_insert_from_buffer()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"start_time\" ] }, "
+                           "{ \"table_name\": \"compressed\", \"index_columns\": [ \"start_time\" ], \"compression\": \"lz\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    // Only size bytes of the buffer are the row.
+    string packet = "{ \"start_time\": \"1469397588523\", \"sdp\": \"v=0 v=0 v=0 v=0 v=0 v=0\" }GARBAGE";
+    auto size = packet.find( "GARBAGE" );
+
+    db.transaction([&](trans_state& ts) {
+        db.insert_json( ts, "segments", (const uint8_t*)packet.data(), size );
+        db.insert_json( ts, "compressed", (const uint8_t*)packet.data(), size );
+    });
+
+    for( auto table : { "segments", "compressed" } )
+    {
+        auto iter = db.get_iterator( table, "start_time" );
+        iter.find( "1469397588523" );
+        UT_ASSERT( iter.valid() );
+        UT_ASSERT( iter.current_data() == packet.substr( 0, size ) );
+    }
+}
+
+void json_database_test::test_json_extractor()
+{
+    json_extractor ex( vector<string>{ "start_time", "camera" } );
+
+    auto extract = [&](const string& row) {
+        return ex.extract( (const uint8_t*)row.data(), row.size() );
+    };
+
+    UT_ASSERT( extract( "{}" ).empty() );
+    UT_ASSERT( extract( " { \"start_time\" : 42 , \"camera\":\"a\" } " ) == nlohmann::json::parse( "{ \"start_time\": 42, \"camera\": \"a\" }" ) );
+
+    // Long strings with escaped quotes, nested fields with the same names and escaped names.
+    string tricky = "{ \"sdp\": \"a long string with \\\"camera\\\": \\\"x\\\" and \\\\ in it, long enough for a few blocks\", "
+                      "\"nested\": { \"camera\": \"no\", \"list\": [ 1, { \"start_time\": 0 }, \"]}\" ] }, "
+                      "\"cam\\u0065ra\": [ \"b\", 2 ], "
+                      "\"start_time\": -1.5e3 }";
+    auto j = extract( tricky );
+    UT_ASSERT( j.size() == 2 );
+    UT_ASSERT( j["camera"] == nlohmann::json::parse( "[ \"b\", 2 ]" ) );
+    UT_ASSERT( j["start_time"].get<double>() == -1500.0 );
+
+    // Missing fields are just missing.
+    UT_ASSERT( extract( "{ \"camera\": null, \"other\": true }" ) == nlohmann::json::parse( "{ \"camera\": null }" ) );
+
+    // Repeated fields keep their last value, like the full parser.
+    string dups = "{ \"camera\": \"a\", \"start_time\": 1, \"camera\": \"b\", \"other\": 0, \"camera\": \"c\" }";
+    UT_ASSERT( extract( dups ) == nlohmann::json::parse( "{ \"camera\": \"c\", \"start_time\": 1 }" ) );
+    UT_ASSERT( extract( dups )["camera"] == nlohmann::json::parse( dups )["camera"] );
+
+    // So the whole object is scanned, even after every field has been seen.
+    UT_ASSERT_THROWS( extract( "{ \"camera\": \"a\", \"start_time\": 1, this is looked at" ), std::runtime_error );
+
+    {
+        // JSON rows go through the extractor, binary rows through the full parser. Both index the same value.
+        std::string schema = "[ { \"table_name\": \"text\", \"index_columns\": [ \"camera\" ] }, "
+                               "{ \"table_name\": \"binary\", \"index_columns\": [ \"camera\" ], \"row_format\": \"binary\" } ]";
+
+        json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+        json_database db( "test.db" );
+
+        db.transaction([&](trans_state& ts) {
+            db.insert_json( ts, "text", dups );
+            db.insert_json( ts, "binary", dups );
+        });
+
+        for( auto table : { "text", "binary" } )
+        {
+            auto iter = db.get_iterator( table, "camera" );
+            iter.find( "c" );
+            UT_ASSERT( iter.valid() );
+            UT_ASSERT( iter.current_field( "camera" ) == "c" );
+            iter.next();
+            UT_ASSERT( !iter.valid() );
+        }
+    }
+
+    UT_ASSERT_THROWS( extract( "[ 1, 2 ]" ), std::runtime_error );
+    UT_ASSERT_THROWS( extract( "{ \"camera\": \"a }" ), std::runtime_error );
+    UT_ASSERT_THROWS( extract( "{ \"camera\" \"a\" }" ), std::runtime_error );
+    UT_ASSERT_THROWS( extract( "{ \"x\": { \"y\": [ 1, 2 }" ), std::runtime_error );
+    UT_ASSERT_THROWS( extract( "{ \"camera\": tru }" ), std::exception );
+}
+
+void json_database_test::test_insert_with_extractor()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" }, "
+                             "\"index_includes\": { \"start_time\": [ \"camera\" ] }, "
+                             "\"compression\": \"lz\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    // Rows are "<camera>|<start_time>|<payload>", not JSON at all.
+    auto extractor = []( const string& colName, const uint8_t* src, size_t size ) {
+        auto parts = tables::split( string( (const char*)src, size ), '|' );
+        if( colName == "camera" )
+            return nlohmann::json( parts[0] );
+        if( colName == "start_time" )
+            return nlohmann::json( s_to_uint64( parts[1] ) );
+        return nlohmann::json();
+    };
+
+    vector<string> rows = { "front|300|payload payload payload", "back|100|payload", "front|200|payload" };
+
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        for( auto& r : rows )
+            pks.push_back( db.insert( ts, "segments", (const uint8_t*)r.data(), r.size(), extractor ) );
+
+        string bad = "side";
+        UT_ASSERT_THROWS( db.insert( ts, "segments", (const uint8_t*)bad.data(), bad.size(), [](const string&, const uint8_t*, size_t) {
+            return nlohmann::json();
+        } ), std::runtime_error );
+    });
+
+    {
+        vector<string> found;
+        for( auto iter = db.get_iterator( "segments", "start_time" ); iter.valid(); iter.next() )
+        {
+            found.push_back( iter.current_data() );
+            UT_ASSERT( iter.current_index_payload()["camera"].get<string>() == tables::split( found.back(), '|' )[0] );
+        }
+        UT_ASSERT( found == vector<string>({ rows[1], rows[2], rows[0] }) );
+    }
+
+    db.transaction([&](trans_state& ts) {
+        db.remove( ts, "segments", pks[2] );
+    });
+
+    {
+        auto iter = db.get_iterator( "segments", "camera" );
+        iter.find( "front" );
+        vector<uint64_t> front;
+        iter.current_pks([&](const uint64_t* p, size_t n) { front.insert( front.end(), p, p + n ); });
+        UT_ASSERT( front == vector<uint64_t>({ pks[0] }) );
+    }
+}
+
+void json_database_test::test_update_json()
+{
+    std::string schema = "[ { \"table_name\": \"jobs\", "
+                             "\"index_columns\": [ \"status\", \"owner\" ], "
+                             "\"compound_indexes\": [ [ \"owner\", \"status\" ] ], "
+                             "\"index_includes\": { \"owner\": [ \"priority\" ] } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    uint64_t a, b;
+    db.transaction([&](trans_state& ts) {
+        a = db.insert_json( ts, "jobs", "{ \"status\": \"queued\", \"owner\": \"alice\", \"priority\": 1 }" );
+        b = db.insert_json( ts, "jobs", "{ \"status\": \"queued\", \"owner\": \"bob\", \"priority\": 2 }" );
+    });
+
+    db.transaction([&](trans_state& ts) {
+        db.update_json( ts, "jobs", a, "{ \"status\": \"running\", \"owner\": \"alice\", \"priority\": 1, \"note\": \"x\" }" );
+        db.update_json( ts, "jobs", b, "{ \"status\": \"queued\", \"owner\": \"bob\", \"priority\": 5 }" );
+
+        UT_ASSERT_THROWS( db.update_json( ts, "jobs", b, "{ \"owner\": \"bob\" }" ), std::runtime_error );
+        UT_ASSERT_THROWS( db.update_json( ts, "jobs", 1000, "{ \"status\": \"queued\", \"owner\": \"bob\" }" ), std::runtime_error );
+    });
+
+    // Walking each whole index shows both the moved entries and that nothing stale was left behind.
+    auto pks_in = [&]( const vector<string>& index ) {
+        vector<uint64_t> pks;
+        for( auto iter = db.get_iterator( "jobs", index ); iter.valid(); iter.next() )
+            pks.push_back( iter.current_pk() );
+        return pks;
+    };
+
+    UT_ASSERT( pks_in( {"status"} ) == vector<uint64_t>({ b, a }) );
+    UT_ASSERT( pks_in( {"owner"} ) == vector<uint64_t>({ a, b }) );
+    UT_ASSERT( pks_in( {"owner", "status"} ) == vector<uint64_t>({ a, b }) );
+
+    {
+        auto iter = db.get_iterator( "jobs", "status" );
+        iter.find( "running" );
+        UT_ASSERT( iter.valid() && iter.current_pk() == a );
+    }
+
+    {
+        // The covering entry for bob was rewritten with the new priority, alice's was left alone.
+        vector<int> priorities;
+        for( auto iter = db.get_iterator( "jobs", "owner" ); iter.valid(); iter.next() )
+            priorities.push_back( iter.current_index_payload()["priority"].get<int>() );
+        UT_ASSERT( priorities == vector<int>({ 1, 5 }) );
+    }
+
+    {
+        auto iter = db.get_pk_iterator( "jobs" );
+        iter.find( a );
+        UT_ASSERT( iter.current_pk() == a );
+        UT_ASSERT( nlohmann::json::parse( iter.current_data() )["note"] == "x" );
+    }
+}
+
+void json_database_test::test_group_commit()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    auto txn_id = [&]() {
+        size_t id = 0;
+        _transaction(db._env, true, [&](trans_state& ts) { id = mdb_txn_id(ts.txn); });
+        return id;
+    };
+
+    UT_ASSERT_THROWS( db.submit([](trans_state&) {}), std::runtime_error );
+
+    db.start_group_commit( 64, std::chrono::milliseconds(5) );
+
+    auto firstTxn = txn_id();
+
+    const size_t NUM_THREADS = 8, NUM_WRITES = 50;
+    vector<thread> writers;
+    for( size_t i = 0; i < NUM_THREADS; ++i )
+    {
+        writers.push_back( thread([&db, i]() {
+            for( size_t w = 0; w < NUM_WRITES; ++w )
+            {
+                db.submit([&](trans_state& ts) {
+                    db.insert_json( ts, "segments", "{ \"time\": " + to_string( (i * NUM_WRITES) + w ) + " }" );
+                }).get();
+            }
+        }) );
+    }
+
+    for( auto& w : writers )
+        w.join();
+
+    // Every writer waits for its last write before sending the next, so writes from different threads
+    // are all that can share a commit.
+    UT_ASSERT( (txn_id() - firstTxn) < (NUM_THREADS * NUM_WRITES) );
+
+    // A write that throws fails alone.
+    auto good1 = db.submit([&](trans_state& ts) { db.insert_json( ts, "segments", "{ \"time\": 1000 }" ); });
+    auto bad = db.submit([&](trans_state& ts) { db.insert_json( ts, "segments", "{ \"nottime\": 1001 }" ); });
+    auto good2 = db.submit([&](trans_state& ts) { db.insert_json( ts, "segments", "{ \"time\": 1002 }" ); });
+
+    good1.get();
+    UT_ASSERT_THROWS( bad.get(), std::runtime_error );
+    good2.get();
+
+    db.stop_group_commit();
+
+    UT_ASSERT_THROWS( db.submit([](trans_state&) {}), std::runtime_error );
+
+    size_t rows = 0;
+    for( auto iter = db.get_iterator( "segments", "time" ); iter.valid(); iter.next() )
+        ++rows;
+    UT_ASSERT( rows == (NUM_THREADS * NUM_WRITES) + 2 );
+}
+
+void json_database_test::test_durability_modes()
+{
+    std::string schema = "[ { \"table_name\": \"telemetry\", \"index_columns\": [ \"sensor\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    for( auto mode : { durability::full, durability::no_meta_sync, durability::map_async } )
+    {
+        json_database db( "test.db", mode );
+
+        db.transaction([&](trans_state& ts) {
+            db.insert_json( ts, "telemetry", "{ \"sensor\": \"a\", \"value\": 1 }" );
+        });
+
+        // full and no_meta_sync sync their data on every commit.
+        if( mode == durability::map_async )
+            UT_ASSERT( db.get_sync_metrics().unsynced_bytes > 0 );
+        else UT_ASSERT( db.get_sync_metrics().unsynced_bytes == 0 );
+
+        db.sync();
+
+        auto metrics = db.get_sync_metrics();
+        UT_ASSERT( metrics.syncs == 1 );
+        UT_ASSERT( metrics.unsynced_bytes == 0 );
+    }
+
+    {
+        // A huge interval, so only the byte threshold can trigger a sync.
+        json_database db( "test.db", durability::periodic_sync, std::chrono::milliseconds(60000), 100 );
+
+        db.transaction([&](trans_state& ts) {
+            db.insert_json( ts, "telemetry", "{ \"sensor\": \"b\", \"value\": 2 }" );
+        });
+
+        UT_ASSERT( db.get_sync_metrics().syncs == 0 );
+
+        db.transaction([&](trans_state& ts) {
+            for( int i = 0; i < 10; ++i )
+                db.insert_json( ts, "telemetry", "{ \"sensor\": \"c\", \"value\": " + to_string(i) + " }" );
+        });
+
+        for( int i = 0; i < 1000 && db.get_sync_metrics().syncs == 0; ++i )
+            ut_usleep(1000);
+
+        auto metrics = db.get_sync_metrics();
+        UT_ASSERT( metrics.syncs == 1 );
+        UT_ASSERT( metrics.unsynced_bytes == 0 );
+        UT_ASSERT( metrics.since_last_sync < std::chrono::milliseconds(60000) );
+    }
+
+    {
+        json_database db( "test.db", durability::periodic_sync, std::chrono::milliseconds(10) );
+
+        db.transaction([&](trans_state& ts) {
+            db.insert_json( ts, "telemetry", "{ \"sensor\": \"d\", \"value\": 3 }" );
+        });
+
+        for( int i = 0; i < 1000 && db.get_sync_metrics().syncs == 0; ++i )
+            ut_usleep(1000);
+
+        UT_ASSERT( db.get_sync_metrics().syncs == 1 );
+
+        // Nothing new to sync, so the thread stays idle.
+        ut_usleep(50000);
+        UT_ASSERT( db.get_sync_metrics().syncs == 1 );
+    }
+
+    json_database db( "test.db" );
+    auto iter = db.get_iterator( "telemetry", "sensor" );
+    size_t rows = 0;
+    for( ; iter.valid(); iter.next() )
+        ++rows;
+    UT_ASSERT( rows == 15 );
+}
+
+void json_database_test::test_map_growth()
+{
+    std::string schema = "[ { \"table_name\": \"telemetry\", \"index_columns\": [ \"sensor\" ] } ]";
+
+    const size_t startSize = 1024 * 1024;
+
+    json_database::create_database( "test.db", startSize, schema );
+
+    string padding( 1000, 'x' );
+
+    {
+        json_database db( "test.db" );
+
+        // A ceiling of 4 MB, reached in 1 MB steps.
+        db.set_map_growth( 2.0, startSize, 4 * startSize );
+
+        for( int t = 0; t < 30; ++t )
+        {
+            db.transaction([&](trans_state& ts) {
+                for( int i = 0; i < 100; ++i )
+                    db.insert_json( ts, "telemetry", "{ \"sensor\": \"s" + to_string(i) + "\", \"pad\": \"" + padding + "\" }" );
+            });
+        }
+
+        UT_ASSERT( db.map_size() > startSize );
+        UT_ASSERT( db.map_size() <= 4 * startSize );
+
+        // Once the ceiling is reached, filling the map is an error and the transaction is rolled back.
+        size_t rowsBefore = db.stats( "telemetry" ).rows;
+
+        UT_ASSERT_THROWS( db.transaction([&](trans_state& ts) {
+            for( int i = 0; i < 10000; ++i )
+                db.insert_json( ts, "telemetry", "{ \"sensor\": \"s\", \"pad\": \"" + padding + "\" }" );
+        }), map_size_error );
+
+        UT_ASSERT( db.stats( "telemetry" ).rows == rowsBefore );
+        UT_ASSERT( db.map_size() == 4 * startSize );
+    }
+
+    {
+        // A resize waits for open iterators to go away.
+        json_database db( "test.db" );
+        db.set_map_growth( 2.0, startSize );
+
+        auto reader = thread([&db]() {
+            auto iter = db.get_iterator( "telemetry", "sensor" );
+            ut_usleep(100000);
+        });
+
+        ut_usleep(10000);
+
+        db.transaction([&](trans_state& ts) {
+            for( int i = 0; i < 10000; ++i )
+                db.insert_json( ts, "telemetry", "{ \"sensor\": \"s\", \"pad\": \"" + padding + "\" }" );
+        });
+
+        reader.join();
+
+        UT_ASSERT( db.map_size() > 4 * startSize );
+    }
+}
+
+void json_database_test::test_remove_range()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"compound_indexes\": [ [ \"camera\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"int64\" }, "
+                             "\"index_includes\": { \"camera\": [ \"start_time\" ] } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 100; ++i )
+            db.insert_json( ts, "segments", "{ \"start_time\": " + to_string(i) + ", \"camera\": \"" + ((i % 2) ? "front" : "back") + "\" }" );
+    });
+
+    auto times_in = [&]( const vector<string>& index ) {
+        vector<int64_t> times;
+        for( auto iter = db.get_iterator( "segments", index ); iter.valid(); iter.next() )
+            times.push_back( nlohmann::json::parse( iter.current_data() )["start_time"].get<int64_t>() );
+        std::sort( times.begin(), times.end() );
+        return times;
+    };
+
+    auto times_between = []( int64_t lo, int64_t hi, int64_t step ) {
+        vector<int64_t> times;
+        for( auto t = lo; t < hi; t += step )
+            times.push_back( t );
+        return times;
+    };
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.remove_range( ts, "segments", "start_time", 0, 50 ) == 50 );
+        UT_ASSERT( db.remove_range( ts, "segments", "start_time", 0, 50 ) == 0 );
+    });
+
+    UT_ASSERT( db.stats( "segments" ).rows == 50 );
+    UT_ASSERT( times_in( {"start_time"} ) == times_between( 50, 100, 1 ) );
+    UT_ASSERT( times_in( {"camera"} ) == times_between( 50, 100, 1 ) );
+    UT_ASSERT( times_in( {"camera", "start_time"} ) == times_between( 50, 100, 1 ) );
+
+    // Leading values of a compound index: every front camera segment before 90.
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.remove_range( ts, "segments", vector<string>{"camera", "start_time"}, nlohmann::json::array({"front"}), nlohmann::json::array({"front", 90}) ) == 20 );
+    });
+
+    auto expected = times_between( 50, 100, 2 );
+    for( int64_t t = 91; t < 100; t += 2 )
+        expected.push_back( t );
+    std::sort( expected.begin(), expected.end() );
+
+    UT_ASSERT( times_in( {"start_time"} ) == expected );
+    UT_ASSERT( times_in( {"camera"} ) == expected );
+    UT_ASSERT( times_in( {"camera", "start_time"} ) == expected );
+
+    // null bounds and empty leading value arrays leave their end open.
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.remove_range( ts, "segments", "start_time", nlohmann::json(), 60 ) == 5 );
+        UT_ASSERT( db.remove_range( ts, "segments", "start_time", 96, nlohmann::json() ) == 4 );
+        UT_ASSERT( db.remove_range( ts, "segments", vector<string>{"camera", "start_time"}, nlohmann::json::array({"front"}), nlohmann::json::array() ) == 3 );
+    });
+
+    UT_ASSERT( times_in( {"start_time"} ) == times_between( 60, 96, 2 ) );
+    UT_ASSERT( times_in( {"camera"} ) == times_between( 60, 96, 2 ) );
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.remove_range( ts, "segments", vector<string>{"camera", "start_time"}, nlohmann::json::array(), nlohmann::json::array() ) == 18 );
+    });
+
+    UT_ASSERT( db.stats( "segments" ).rows == 0 );
+
+    uint64_t lastPK = 0;
+    db.transaction([&](trans_state& ts) {
+        db.truncate( ts, "segments" );
+        lastPK = db.insert_json( ts, "segments", "{ \"start_time\": 1000, \"camera\": \"back\" }" );
+    });
+
+    UT_ASSERT( lastPK == 101 );
+    UT_ASSERT( db.stats( "segments" ).rows == 1 );
+    UT_ASSERT( times_in( {"start_time"} ) == vector<int64_t>({ 1000 }) );
+    UT_ASSERT( times_in( {"camera", "start_time"} ) == vector<int64_t>({ 1000 }) );
+}
+
+void json_database_test::test_remove_with_footprint()
+{
+    std::string schema = "[ { \"table_name\": \"blobs\", "
+                             "\"index_columns\": [ \"name\" ], "
+                             "\"compound_indexes\": [ [ \"name\", \"size\" ] ], "
+                             "\"column_types\": { \"size\": \"int64\" }, "
+                             "\"index_includes\": { \"name\": [ \"size\" ] }, "
+                             "\"compression\": \"lz\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    // "<name>:<payload>", indexed by name and payload size. Only the callback understands these rows.
+    auto extractor = []( const string& colName, const uint8_t* src, size_t size ) {
+        auto colon = std::find( src, src + size, ':' );
+        if( colName == "name" )
+            return nlohmann::json( string( (const char*)src, colon - src ) );
+        return nlohmann::json( (int64_t)((src + size) - (colon + 1)) );
+    };
+
+    vector<string> rows = { "a:" + string( 5000, 'x' ), "b:yy", "a:zzz" };
+
+    vector<uint64_t> pks;
+    db.transaction([&](trans_state& ts) {
+        for( auto& r : rows )
+            pks.push_back( db.insert( ts, "blobs", (const uint8_t*)r.data(), r.size(), extractor ) );
+    });
+
+    db.transaction([&](trans_state& ts) {
+        db.remove( ts, "blobs", pks[0] );
+    });
+
+    auto count = [&]( const vector<string>& index ) {
+        size_t n = 0;
+        for( auto iter = db.get_iterator( "blobs", index ); iter.valid(); iter.next() )
+        {
+            UT_ASSERT( iter.current_data() != rows[0] );
+            ++n;
+        }
+        return n;
+    };
+
+    UT_ASSERT( db.stats( "blobs" ).rows == 2 );
+    UT_ASSERT( count( {"name"} ) == 2 );
+    UT_ASSERT( count( {"name", "size"} ) == 2 );
+
+    {
+        auto iter = db.get_iterator( "blobs", "name" );
+        iter.find( "a" );
+        UT_ASSERT( iter.current_pk() == pks[2] );
+        UT_ASSERT( iter.current_data() == rows[2] );
+        UT_ASSERT( iter.current_index_payload()["size"] == 3 );
+    }
+}
+
+void json_database_test::test_ttl_expiry()
+{
+    UT_ASSERT_THROWS( json_database::create_database( "test.db", 16 * (1024*1024),
+                          "[ { \"table_name\": \"segments\", \"index_columns\": [ \"start_time\" ], "
+                              "\"ttl\": { \"column\": \"start_time\", \"seconds\": 3600 } } ]" ), std::runtime_error );
+
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" }, "
+                             "\"ttl\": { \"column\": \"start_time\", \"seconds\": 3600 } }, "
+                           "{ \"table_name\": \"cameras\", \"index_columns\": [ \"name\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    const int64_t minute = 60 * 1000;
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    // Rows 5, 15, ... 115 minutes old, inserted newest first so pk order isn't time order.
+    db.transaction([&](trans_state& ts) {
+        for( int k = 0; k < 12; ++k )
+            db.insert_json( ts, "segments", "{ \"start_time\": " + to_string( now - ((k * 10) + 5) * minute ) + ", \"camera\": \"c" + to_string(k % 3) + "\" }" );
+    });
+
+    UT_ASSERT_THROWS( db.expire( "cameras" ), std::runtime_error );
+
+    UT_ASSERT( db.expire( "segments", 4 ) == 6 );
+    UT_ASSERT( db.expire( "segments", 4 ) == 0 );
+
+    auto oldest_in = [&]( const string& index ) {
+        int64_t oldest = std::numeric_limits<int64_t>::max();
+        size_t rows = 0;
+        for( auto iter = db.get_iterator( "segments", index ); iter.valid(); iter.next() )
+        {
+            oldest = std::min( oldest, nlohmann::json::parse( iter.current_data() )["start_time"].get<int64_t>() );
+            ++rows;
+        }
+        return std::make_pair( rows, oldest );
+    };
+
+    UT_ASSERT( oldest_in( "start_time" ) == std::make_pair( (size_t)6, now - 55 * minute ) );
+    UT_ASSERT( oldest_in( "camera" ) == std::make_pair( (size_t)6, now - 55 * minute ) );
+
+    db.start_expiry( std::chrono::milliseconds(10) );
+
+    db.transaction([&](trans_state& ts) {
+        db.insert_json( ts, "segments", "{ \"start_time\": " + to_string( now - 120 * minute ) + ", \"camera\": \"c0\" }" );
+    });
+
+    for( int i = 0; i < 1000 && db.stats( "segments" ).rows > 6; ++i )
+        ut_usleep(1000);
+
+    db.stop_expiry();
+
+    UT_ASSERT( oldest_in( "camera" ) == std::make_pair( (size_t)6, now - 55 * minute ) );
+
+    // A stopped expiry thread mustn't cut manual expire()s short.
+    db.transaction([&](trans_state& ts) {
+        for( int k = 0; k < 10; ++k )
+            db.insert_json( ts, "segments", "{ \"start_time\": " + to_string( now - (120 + k) * minute ) + ", \"camera\": \"c0\" }" );
+    });
+
+    UT_ASSERT( db.expire( "segments", 3 ) == 10 );
+    UT_ASSERT( oldest_in( "camera" ) == std::make_pair( (size_t)6, now - 55 * minute ) );
+}
+
+void json_database_test::test_savepoints()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"start_time\" ] } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    {
+        json_database db( "test.db" );
+
+        db.transaction([&](trans_state& ts) {
+            UT_ASSERT_THROWS( db.savepoint( ts, [](trans_state&) {} ), std::runtime_error );
+        });
+    }
+
+    json_database db( "test.db", durability::no_meta_sync, std::chrono::milliseconds(1000), 64 * 1024 * 1024, true );
+
+    size_t failed = 0;
+    uint64_t lastGood = 0;
+
+    db.transaction([&](trans_state& ts) {
+        for( int batch = 0; batch < 4; ++batch )
+        {
+            try
+            {
+                db.savepoint( ts, [&](trans_state& sts) {
+                    for( int i = 0; i < 10; ++i )
+                    {
+                        // The third batch has a bad row at the end, after 9 good ones.
+                        if( batch == 2 && i == 9 )
+                            db.insert_json( sts, "segments", "{ \"nope\": 1 }" );
+                        else lastGood = db.insert_json( sts, "segments", "{ \"start_time\": \"" + to_string( (batch * 10) + i ) + "\" }" );
+                    }
+                } );
+            }
+            catch( std::exception& )
+            {
+                ++failed;
+            }
+        }
+    });
+
+    UT_ASSERT( failed == 1 );
+    UT_ASSERT( db.stats( "segments" ).rows == 30 );
+
+    size_t entries = 0;
+    for( auto iter = db.get_iterator( "segments", "start_time" ); iter.valid(); iter.next() )
+    {
+        auto t = s_to_uint64( nlohmann::json::parse( iter.current_data() )["start_time"].get<string>() );
+        UT_ASSERT( t < 20 || t >= 30 );
+        ++entries;
+    }
+    UT_ASSERT( entries == 30 );
+
+    // The failed batch's pks were handed back, so pks stay dense.
+    UT_ASSERT( lastGood == 30 );
+
+    // Group commit uses a savepoint per write.
+    db.start_group_commit( 64, std::chrono::milliseconds(5) );
+
+    auto good = db.submit([&](trans_state& ts) { db.insert_json( ts, "segments", "{ \"start_time\": \"100\" }" ); });
+    auto bad = db.submit([&](trans_state& ts) { db.insert_json( ts, "segments", "{ \"nope\": 1 }" ); });
+
+    good.get();
+    UT_ASSERT_THROWS( bad.get(), std::runtime_error );
+
+    db.stop_group_commit();
+
+    UT_ASSERT( db.stats( "segments" ).rows == 31 );
+}
+
+void json_database_test::test_data_views()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", \"index_columns\": [ \"camera\" ] }, "
+                           "{ \"table_name\": \"packed\", \"index_columns\": [ \"camera\" ], \"compression\": \"lz\" } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    vector<string> rows = { "{ \"camera\": \"a\", \"note\": \"first first first first\" }",
+                            "{ \"camera\": \"b\", \"note\": \"second second second second\" }" };
+
+    db.transaction([&](trans_state& ts) {
+        for( auto& r : rows )
+        {
+            db.insert_json( ts, "segments", r );
+            db.insert_json( ts, "packed", r );
+        }
+    });
+
+    for( auto table : { "segments", "packed" } )
+    {
+        auto iter = db.get_iterator( table, "camera" );
+
+        auto data = iter.current_data_view();
+        auto again = iter.current_data_view();
+        UT_ASSERT( data.str() == rows[0] );
+        UT_ASSERT( data.data() == again.data() );
+
+        auto key = iter.current_key_view();
+        string expected;
+        encode_key_string( expected, "a" );
+        UT_ASSERT( key.str() == expected );
+
+        iter.next();
+
+        UT_ASSERT( iter.current_data_view().str() == rows[1] );
+
+#ifndef NDEBUG
+        UT_ASSERT_THROWS( data.size(), std::runtime_error );
+        UT_ASSERT_THROWS( key.data(), std::runtime_error );
+#endif
+    }
+
+    {
+        auto iter = db.get_pk_iterator( "segments" );
+        auto key = iter.current_key_view();
+        UT_ASSERT( key.size() == sizeof(uint64_t) );
+
+        uint64_t pk;
+        memcpy( &pk, key.data(), sizeof(pk) );
+        UT_ASSERT( pk == iter.current_pk() );
+    }
+
+#ifndef NDEBUG
+    {
+        // Views of destroyed and moved from iterators are caught too.
+        auto orphan = db.get_iterator( "segments", "camera" ).current_data_view();
+        UT_ASSERT_THROWS( orphan.data(), std::runtime_error );
+
+        auto iter = db.get_iterator( "packed", "camera" );
+        auto data = iter.current_data_view();
+        auto moved = std::move( iter );
+        UT_ASSERT_THROWS( data.size(), std::runtime_error );
+        UT_ASSERT( moved.current_data_view().str() == rows[0] );
+
+        data_view empty;
+        UT_ASSERT( empty.size() == 0 );
+    }
+#endif
+}
+
+void json_database_test::test_iterator_stepping()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\" ], "
+                             "\"column_types\": { \"start_time\": \"timestamp\" } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    const size_t NUM_ROWS = 5000;
+
+    vector<string> rows;
+    for( size_t i = 0; i < NUM_ROWS; ++i )
+        rows.push_back( "{ \"start_time\": " + to_string( i ) + " }" );
+
+    db.transaction([&](trans_state& ts) {
+        db.insert_json_batch( ts, "segments", rows );
+    });
+
+    // tables_iterator_bench checks that none of this allocates, over a 1M row index.
+    auto iter = db.get_iterator( "segments", "start_time" );
+
+    size_t steps = 0;
+    uint64_t pkSum = 0, bytes = 0;
+
+    for( ; iter.valid(); iter.next(), ++steps )
+    {
+        pkSum += iter.current_pk();
+        bytes += iter.current_key_view().size() + iter.current_data_view().size();
+    }
+
+    iter.find( (int64_t)(NUM_ROWS - 1) );
+
+    for( ; iter.valid(); iter.prev(), ++steps )
+        pkSum -= iter.current_pk();
+
+    UT_ASSERT( steps == 2 * NUM_ROWS );
+    UT_ASSERT( pkSum == 0 );
+    UT_ASSERT( bytes > 0 );
+}
+
+void json_database_test::test_find_range()
+{
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"start_time\", \"camera\" ], "
+                             "\"compound_indexes\": [ [ \"camera\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"int64\" } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    // Two rows per start_time, one per camera.
+    db.transaction([&](trans_state& ts) {
+        for( int i = 0; i < 100; ++i )
+        {
+            db.insert_json( ts, "segments", "{ \"start_time\": " + to_string(i) + ", \"camera\": \"back\" }" );
+            db.insert_json( ts, "segments", "{ \"start_time\": " + to_string(i) + ", \"camera\": \"front\" }" );
+        }
+    });
+
+    auto forward = []( json_database::iterator& iter ) {
+        vector<string> rows;
+        for( ; iter.valid(); iter.next() )
+        {
+            auto j = nlohmann::json::parse( iter.current_data() );
+            rows.push_back( j["camera"].get<string>() + to_string( j["start_time"].get<int64_t>() ) );
+        }
+        return rows;
+    };
+
+    auto backward = []( json_database::iterator& iter ) {
+        vector<string> rows;
+        for( ; iter.valid(); iter.prev() )
+        {
+            auto j = nlohmann::json::parse( iter.current_data() );
+            rows.push_back( j["camera"].get<string>() + to_string( j["start_time"].get<int64_t>() ) );
+        }
+        std::reverse( rows.begin(), rows.end() );
+        return rows;
+    };
+
+    auto times = []( const vector<string>& rows ) {
+        vector<int64_t> result;
+        for( auto& r : rows )
+            result.push_back( stoll( r.substr( r.find_first_of( "0123456789" ) ) ) );
+        std::sort( result.begin(), result.end() );
+        return result;
+    };
+
+    auto iter = db.get_iterator( "segments", "start_time" );
+
+    // [10, 20)
+    iter.find_range( 10, 20 );
+    auto rows = forward( iter );
+    UT_ASSERT( rows.size() == 20 );
+    UT_ASSERT( times( rows ).front() == 10 && times( rows ).back() == 19 );
+
+    iter.find_range( 10, 20, true, false, true );
+    UT_ASSERT( times( backward( iter ) ) == times( rows ) );
+
+    // (10, 20]
+    iter.find_range( 10, 20, false, true );
+    rows = forward( iter );
+    UT_ASSERT( rows.size() == 20 );
+    UT_ASSERT( times( rows ).front() == 11 && times( rows ).back() == 20 );
+
+    iter.find_range( 10, 20, false, true, true );
+    UT_ASSERT( times( backward( iter ) ) == times( rows ) );
+
+    // Open ends.
+    iter.find_range( nlohmann::json(), 5 );
+    UT_ASSERT( forward( iter ).size() == 10 );
+    iter.find_range( 95, nlohmann::json(), true, false, true );
+    UT_ASSERT( backward( iter ).size() == 10 );
+    iter.find_range( nlohmann::json(), nlohmann::json() );
+    UT_ASSERT( forward( iter ).size() == 200 );
+
+    // Empty and out of data ranges.
+    iter.find_range( 20, 20 );
+    UT_ASSERT( !iter.valid() );
+    iter.find_range( 20, 20, true, true, true );
+    UT_ASSERT( backward( iter ).size() == 2 );
+    iter.find_range( 200, 300 );
+    UT_ASSERT( !iter.valid() );
+    iter.find_range( -100, -1, true, false, true );
+    UT_ASSERT( !iter.valid() );
+
+    // Stepping back out of the range invalidates too.
+    iter.find_range( 50, 60 );
+    UT_ASSERT( iter.valid() );
+    iter.prev();
+    UT_ASSERT( !iter.valid() );
+
+    // find() drops the range.
+    iter.find( 98 );
+    UT_ASSERT( forward( iter ).size() == 4 );
+
+    // Leading values of a compound index, inclusive bounds cover every entry that begins with them.
+    auto compound = db.get_iterator( "segments", vector<string>{ "camera", "start_time" } );
+
+    compound.find_range( nlohmann::json::array({"back"}), nlohmann::json::array({"back"}), true, true );
+    rows = forward( compound );
+    UT_ASSERT( rows.size() == 100 );
+    UT_ASSERT( rows.front() == "back0" && rows.back() == "back99" );
+
+    compound.find_range( nlohmann::json::array({"back"}), nlohmann::json::array({"back"}), true, true, true );
+    UT_ASSERT( backward( compound ) == rows );
+
+    compound.find_range( nlohmann::json::array({"back"}), nlohmann::json::array({"front", 3}), false );
+    rows = forward( compound );
+    UT_ASSERT( (rows == vector<string>{ "front0", "front1", "front2" }) );
+
+    compound.find_range( nlohmann::json::array({"back", 97}), nlohmann::json::array({"front", 2}), true, true, true );
+    rows = backward( compound );
+    UT_ASSERT( (rows == vector<string>{ "back97", "back98", "back99", "front0", "front1", "front2" }) );
+
+    // pk iterators range over pks.
+    auto pks = db.get_iterator( "segments", vector<string>() );
+
+    vector<uint64_t> found;
+    for( pks.find_range( 5, 8, true, true, true ); pks.valid(); pks.prev() )
+        found.push_back( pks.current_pk() );
+    UT_ASSERT( (found == vector<uint64_t>{ 8, 7, 6, 5 }) );
+
+    UT_ASSERT_THROWS( pks.find_range( "a", 8 ), std::exception );
+}
+
+void json_database_test::test_embedded_nul_keys()
+{
+    for( auto val : { string(), string("a"), string("a\0", 2), string("a\0b", 3), string("\0\0", 2) } )
+    {
+        string key;
+        encode_key_string( key, val );
+        key += "x";
+
+        auto p = (const uint8_t*)key.data();
+        UT_ASSERT( decode_key_string( p, p + key.size() ) == val );
+        UT_ASSERT( *p == 'x' );
+    }
+
+    std::string schema = "[ { \"table_name\": \"segments\", "
+                             "\"index_columns\": [ \"name\" ], "
+                             "\"compound_indexes\": [ [ \"name\", \"start_time\" ] ], "
+                             "\"column_types\": { \"start_time\": \"int64\" } } ]";
+
+    json_database::create_database( "test.db", 16 * (1024*1024), schema );
+
+    json_database db( "test.db" );
+
+    db.transaction([&](trans_state& ts) {
+        db.insert_json( ts, "segments", "{ \"name\": \"a\\u0000b\", \"start_time\": 0 }" );
+        db.insert_json( ts, "segments", "{ \"name\": \"b\", \"start_time\": -1 }" );
+        db.insert_json( ts, "segments", "{ \"name\": \"a\", \"start_time\": 9223372036854775807 }" );
+        db.insert_json( ts, "segments", "{ \"name\": \"a\\u0000\", \"start_time\": 5 }" );
+    });
+
+    auto names = []( json_database::iterator& iter ) {
+        vector<string> result;
+        for( ; iter.valid(); iter.next() )
+            result.push_back( nlohmann::json::parse( iter.current_data() )["name"].get<string>() );
+        return result;
+    };
+
+    // Tuple order: every "a" entry sorts before every "a\0..." entry, whatever its start_time.
+    auto iter = db.get_iterator( "segments", vector<string>{ "name", "start_time" } );
+    UT_ASSERT( (names( iter ) == vector<string>{ "a", string("a\0", 2), string("a\0b", 3), "b" }) );
+
+    iter.find_range( nlohmann::json::array({"a"}), nlohmann::json::array({"a"}), true, true );
+    UT_ASSERT( (names( iter ) == vector<string>{ "a" }) );
+
+    iter.find_range( nlohmann::json::array({string("a\0", 2)}), nlohmann::json::array({string("a\0", 2)}), true, true );
+    UT_ASSERT( (names( iter ) == vector<string>{ string("a\0", 2) }) );
+
+    db.transaction([&](trans_state& ts) {
+        UT_ASSERT( db.remove_range( ts, "segments", vector<string>{ "name", "start_time" }, nlohmann::json::array({"a"}), nlohmann::json::array({string("a\0b", 3)}) ) == 2 );
+    });
+
+    auto left = db.get_iterator( "segments", "name" );
+    UT_ASSERT( (names( left ) == vector<string>{ string("a\0b", 3), "b" }) );
+}